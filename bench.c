@@ -0,0 +1,266 @@
+/*
+ * Copyright (C) 2020 Paul Cercueil <paul@crapouillou.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Runs a synthetic MIPS loop through the recompiler and through the
+ * interpreter, and reports the number of emulated cycles per second.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "lightrec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) ? sizeof(x) / sizeof((x)[0]) : 0)
+
+#define RAM_SIZE	0x200000
+#define BIOS_SIZE	0x80000
+#define SCRATCH_SIZE	0x400
+
+#define PSX_CLOCK	33868800
+#define FRAME_CYCLES	(PSX_CLOCK / 60)
+
+#define BENCH_PC	0x80010000
+
+static u8 ram[RAM_SIZE], bios[BIOS_SIZE], scratch[SCRATCH_SIZE];
+
+/*
+ * start:	lui	s0, 0x8000
+ *		ori	s0, s0, 0x1000
+ *		ori	t0, zero, 0x1000
+ * loop:	addiu	t1, t1, 1
+ *		xor	t2, t2, t1
+ *		sll	t3, t1, 2
+ *		addu	t4, t4, t3
+ *		sw	t4, 0(s0)
+ *		lw	t5, 0(s0)
+ *		addiu	t0, t0, -1
+ *		bnez	t0, loop
+ *		nop
+ *		j	start
+ *		nop
+ */
+static const u32 bench_code[] = {
+	0x3c108000, 0x36101000, 0x34081000,
+	0x25290001, 0x01495026, 0x00095880, 0x018b6021,
+	0xae0c0000, 0x8e0d0000, 0x2508ffff, 0x1500fff8,
+	0x00000000, 0x08004000, 0x00000000,
+};
+
+static void bench_sb(struct lightrec_state *state, u32 addr, u8 data)
+{
+}
+
+static void bench_sh(struct lightrec_state *state, u32 addr, u16 data)
+{
+}
+
+static void bench_sw(struct lightrec_state *state, u32 addr, u32 data)
+{
+}
+
+static u8 bench_lb(struct lightrec_state *state, u32 addr)
+{
+	return 0;
+}
+
+static u16 bench_lh(struct lightrec_state *state, u32 addr)
+{
+	return 0;
+}
+
+static u32 bench_lw(struct lightrec_state *state, u32 addr)
+{
+	return 0;
+}
+
+static const struct lightrec_mem_map_ops bench_io_ops = {
+	.sb = bench_sb,
+	.sh = bench_sh,
+	.sw = bench_sw,
+	.lb = bench_lb,
+	.lh = bench_lh,
+	.lw = bench_lw,
+};
+
+static struct lightrec_mem_map bench_map[] = {
+	[PSX_MAP_KERNEL_USER_RAM] = {
+		.pc = 0x00000000,
+		.length = RAM_SIZE,
+		.address = ram,
+	},
+	[PSX_MAP_BIOS] = {
+		.pc = 0x1fc00000,
+		.length = BIOS_SIZE,
+		.address = bios,
+	},
+	[PSX_MAP_SCRATCH_PAD] = {
+		.pc = 0x1f800000,
+		.length = SCRATCH_SIZE,
+		.address = scratch,
+	},
+	[PSX_MAP_PARALLEL_PORT] = {
+		.pc = 0x1f000000,
+		.length = 0x10000,
+		.ops = &bench_io_ops,
+	},
+	[PSX_MAP_HW_REGISTERS] = {
+		.pc = 0x1f801000,
+		.length = 0x2000,
+		.ops = &bench_io_ops,
+	},
+	[PSX_MAP_CACHE_CONTROL] = {
+		.pc = 0x5ffe0130,
+		.length = 4,
+		.ops = &bench_io_ops,
+	},
+	[PSX_MAP_MIRROR1] = {
+		.pc = 0x00200000,
+		.length = RAM_SIZE,
+		.mirror_of = &bench_map[PSX_MAP_KERNEL_USER_RAM],
+	},
+	[PSX_MAP_MIRROR2] = {
+		.pc = 0x00400000,
+		.length = RAM_SIZE,
+		.mirror_of = &bench_map[PSX_MAP_KERNEL_USER_RAM],
+	},
+	[PSX_MAP_MIRROR3] = {
+		.pc = 0x00600000,
+		.length = RAM_SIZE,
+		.mirror_of = &bench_map[PSX_MAP_KERNEL_USER_RAM],
+	},
+};
+
+static u32 bench_cop_read(struct lightrec_state *state, u8 reg)
+{
+	return 0;
+}
+
+static void bench_cop_write(struct lightrec_state *state, u8 reg, u32 value)
+{
+}
+
+static void bench_cop_op(struct lightrec_state *state, u32 opcode)
+{
+}
+
+static const struct lightrec_ops bench_ops = {
+	.cop0_ops = {
+		.mtc = bench_cop_write,
+		.ctc = bench_cop_write,
+		.op = bench_cop_op,
+	},
+	.cop2_ops = {
+		.mfc = bench_cop_read,
+		.cfc = bench_cop_read,
+		.mtc = bench_cop_write,
+		.ctc = bench_cop_write,
+		.op = bench_cop_op,
+	},
+};
+
+static void bench_load_code(void)
+{
+	unsigned int i;
+	u32 opcode;
+	u8 *ptr = &ram[BENCH_PC & (RAM_SIZE - 1)];
+
+	/* The PSX is little-endian, whatever the host is */
+	for (i = 0; i < ARRAY_SIZE(bench_code); i++) {
+		opcode = bench_code[i];
+
+		*ptr++ = opcode;
+		*ptr++ = opcode >> 8;
+		*ptr++ = opcode >> 16;
+		*ptr++ = opcode >> 24;
+	}
+}
+
+static double bench_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_run(const char *name, struct lightrec_state *state,
+		     unsigned int frames)
+{
+	unsigned int i;
+	u32 pc = BENCH_PC, cycles = 0;
+	double start, elapsed;
+
+	if (!state) {
+		fprintf(stderr, "Unable to init the %s\n", name);
+		return -1;
+	}
+
+	start = bench_time();
+
+	for (i = 0; i < frames; i++) {
+		cycles += FRAME_CYCLES;
+
+		pc = lightrec_execute(state, pc, cycles);
+
+		if (lightrec_exit_flags(state) & LIGHTREC_EXIT_SEGFAULT) {
+			fprintf(stderr, "%s: segfault at PC 0x%08x\n",
+				name, pc);
+			lightrec_destroy(state);
+			return -1;
+		}
+	}
+
+	elapsed = bench_time() - start;
+	cycles = lightrec_current_cycle_count(state);
+
+	printf("%-12s %10u cycles in %7.3f s: %8.2f Mcycles/s (%.2fx)\n",
+	       name, cycles, elapsed, cycles / elapsed / 1e6,
+	       cycles / elapsed / PSX_CLOCK);
+
+	lightrec_destroy(state);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int frames = 600;
+	int ret;
+
+	if (argc > 1)
+		frames = strtoul(argv[1], NULL, 0);
+
+	if (!frames) {
+		fprintf(stderr, "Usage: %s [nb_frames]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	bench_load_code();
+
+	ret = bench_run("recompiler", lightrec_init(argv[0], bench_map,
+						    ARRAY_SIZE(bench_map),
+						    &bench_ops), frames);
+
+	ret |= bench_run("interpreter",
+			 lightrec_init_interpreter(argv[0], bench_map,
+						   ARRAY_SIZE(bench_map),
+						   &bench_ops), frames);
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
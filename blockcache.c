@@ -110,6 +110,18 @@ void lightrec_unregister_block(struct blockcache *cache, struct block *block)
 	pr_err("Block at PC 0x%x is not in cache\n", block->pc);
 }
 
+void lightrec_blockcache_foreach(struct blockcache *cache,
+				 void (*func)(struct block *, void *),
+				 void *data)
+{
+	struct block *block;
+	unsigned int i;
+
+	for (i = 0; i < LUT_SIZE; i++)
+		for (block = cache->lut[i]; block; block = block->next)
+			func(block, data);
+}
+
 void lightrec_free_block_cache(struct blockcache *cache)
 {
 	struct block *block, *next;
@@ -32,4 +32,8 @@ _Bool lightrec_block_is_outdated(struct block *block);
 void lightrec_mark_for_recompilation(struct blockcache *cache,
 				     struct block *block);
 
+void lightrec_blockcache_foreach(struct blockcache *cache,
+				 void (*func)(struct block *, void *),
+				 void *data);
+
 #endif /* __BLOCKCACHE_H__ */
@@ -45,13 +45,16 @@ static bool is_unconditional_jump(const struct opcode *op)
 	}
 }
 
-static bool is_syscall(const struct opcode *op)
+static bool is_syscall(const struct lightrec_state *state,
+		       const struct opcode *op)
 {
+	/* With the COP0 registers mirrored, writes to SR and Cause only exit
+	 * the block when the host has to be notified */
 	return (op->i.op == OP_SPECIAL && (op->r.op == OP_SPECIAL_SYSCALL ||
 					   op->r.op == OP_SPECIAL_BREAK)) ||
 		(op->i.op == OP_CP0 && (op->r.rs == OP_CP0_MTC0 ||
 					op->r.rs == OP_CP0_CTC0) &&
-		 (op->r.rd == 12 || op->r.rd == 13));
+		 (op->r.rd == 12 || op->r.rd == 13) && !state->mirror_cop0);
 }
 
 void lightrec_free_opcode_list(struct lightrec_state *state, struct opcode *list)
@@ -92,7 +95,7 @@ struct opcode * lightrec_disassemble(struct lightrec_state *state,
 
 		/* NOTE: The block disassembly ends after the opcode that
 		 * follows an unconditional jump (delay slot) */
-		if (stop_next || is_syscall(curr))
+		if (stop_next || is_syscall(state, curr))
 			break;
 		else if (is_unconditional_jump(curr))
 			stop_next = true;
@@ -104,17 +107,6 @@ struct opcode * lightrec_disassemble(struct lightrec_state *state,
 	return head;
 }
 
-unsigned int lightrec_cycles_of_opcode(union code code)
-{
-	switch (code.i.op) {
-	case OP_META_REG_UNLOAD:
-	case OP_META_SYNC:
-		return 0;
-	default:
-		return 2;
-	}
-}
-
 #if ENABLE_DISASSEMBLER
 void lightrec_print_disassembly(const struct block *block,
 				const u32 *code, unsigned int length)
@@ -29,7 +29,13 @@
 #define LIGHTREC_EMULATE_BRANCH	(1 << 4)
 #define LIGHTREC_LOCAL_BRANCH	(1 << 5)
 #define LIGHTREC_HW_IO		(1 << 6)
-#define LIGHTREC_MULT32		(1 << 7)
+#define LIGHTREC_NO_HI		(1 << 7)
+#define LIGHTREC_BATCHED	(1 << 8)
+#define LIGHTREC_NO_LO		(1 << 9)
+#define LIGHTREC_UNALIGNED_PAIR	(1 << 10)
+#define LIGHTREC_COALESCED	(1 << 11)
+#define LIGHTREC_BULK_LOOP	(1 << 12)
+#define LIGHTREC_IDLE_LOOP	(1 << 13)
 
 struct block;
 
@@ -204,7 +210,16 @@ struct opcode * lightrec_disassemble(struct lightrec_state *state,
 void lightrec_free_opcode_list(struct lightrec_state *state,
 			       struct opcode *list);
 
-unsigned int lightrec_cycles_of_opcode(union code code);
+static inline unsigned int lightrec_cycles_of_opcode(union code code)
+{
+	switch (code.i.op) {
+	case OP_META_REG_UNLOAD:
+	case OP_META_SYNC:
+		return 0;
+	default:
+		return 2;
+	}
+}
 
 void lightrec_print_disassembly(const struct block *block,
 				const u32 *code, unsigned int length);
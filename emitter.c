@@ -16,6 +16,7 @@
 #include "debug.h"
 #include "disassembler.h"
 #include "emitter.h"
+#include "gte.h"
 #include "optimizer.h"
 #include "regcache.h"
 
@@ -23,6 +24,14 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+/* Hosts on which native loads and stores don't need to be aligned */
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__) || \
+	defined(__ARM_FEATURE_UNALIGNED)
+#define HAS_UNALIGNED_ACCESS 1
+#else
+#define HAS_UNALIGNED_ACCESS 0
+#endif
+
 typedef void (*lightrec_rec_func_t)(const struct block *,
 				    const struct opcode *, u32);
 
@@ -144,6 +153,25 @@ static void rec_JAL(const struct block *block, const struct opcode *op, u32 pc)
 				   31, pc + 8, true);
 }
 
+static void rec_idle_loop_exit(const struct block *block)
+{
+	struct regcache *reg_cache = block->state->reg_cache;
+	jit_state_t *_jit = block->_jit;
+	u8 tmp;
+
+	tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+	jit_ldxi_i(tmp, LIGHTREC_REG_STATE,
+		   offsetof(struct lightrec_state, exit_flags));
+	jit_ori(tmp, tmp, LIGHTREC_EXIT_CHECK_INTERRUPT);
+	jit_stxi_i(offsetof(struct lightrec_state, exit_flags),
+		   LIGHTREC_REG_STATE, tmp);
+
+	lightrec_free_reg(reg_cache, tmp);
+
+	jit_movi(LIGHTREC_REG_CYCLE, 0);
+}
+
 static void rec_b(const struct block *block, const struct opcode *op, u32 pc,
 		  jit_code_t code, u32 link, bool unconditional, bool bz)
 {
@@ -196,15 +224,24 @@ static void rec_b(const struct block *block, const struct opcode *op, u32 pc,
 		lightrec_storeback_regs(reg_cache, _jit);
 
 		offset = op->offset + 1 + (s16)op->i.imm;
-		pr_debug("Adding local branch to offset 0x%x\n", offset << 2);
-		branch = &block->state->local_branches[
-			block->state->nb_local_branches++];
-
-		branch->target = offset;
-		if (is_forward)
-			branch->branch = jit_jmpi();
-		else
-			branch->branch = jit_bgti(LIGHTREC_REG_CYCLE, 0);
+		if (op->flags & LIGHTREC_IDLE_LOOP) {
+			/* Nothing can change until the next interrupt or HW
+			 * event; skip straight to the target cycle */
+			pr_debug("Fast-forwarding idle loop at offset 0x%x\n",
+				 op->offset << 2);
+			rec_idle_loop_exit(block);
+		} else {
+			pr_debug("Adding local branch to offset 0x%x\n",
+				 offset << 2);
+			branch = &block->state->local_branches[
+				block->state->nb_local_branches++];
+
+			branch->target = offset;
+			if (is_forward)
+				branch->branch = jit_jmpi();
+			else
+				branch->branch = jit_bgti(LIGHTREC_REG_CYCLE, 0);
+		}
 	}
 
 	if (!(op->flags & LIGHTREC_LOCAL_BRANCH) || !is_forward) {
@@ -603,16 +640,12 @@ static void rec_alu_mult(const struct block *block,
 {
 	struct regcache *reg_cache = block->state->reg_cache;
 	jit_state_t *_jit = block->_jit;
-	u8 lo, hi, rs, rt;
+	bool no_lo = op->flags & LIGHTREC_NO_LO;
+	bool no_hi = op->flags & LIGHTREC_NO_HI;
+	u8 lo, hi, rs, rt, rd = 0;
 
 	jit_note(__FILE__, __LINE__);
 
-	lo = lightrec_alloc_reg_out(reg_cache, _jit, REG_LO);
-	if (!(op->flags & LIGHTREC_MULT32))
-		hi = lightrec_alloc_reg_out_ext(reg_cache, _jit, REG_HI);
-	else if (__WORDSIZE == 64)
-		hi = lightrec_alloc_reg_temp(reg_cache, _jit);
-
 	if (__WORDSIZE == 32 || !is_signed) {
 		rs = lightrec_alloc_reg_in(reg_cache, _jit, op->r.rs);
 		rt = lightrec_alloc_reg_in(reg_cache, _jit, op->r.rt);
@@ -621,10 +654,27 @@ static void rec_alu_mult(const struct block *block,
 		rt = lightrec_alloc_reg_in_ext(reg_cache, _jit, op->r.rt);
 	}
 
+	/* A merged MFLO writes the low word to rd; compute it there directly
+	 * if LO itself is dead */
+	if (op->r.rd)
+		rd = lightrec_alloc_reg_out(reg_cache, _jit, op->r.rd);
+
+	if (!no_lo)
+		lo = lightrec_alloc_reg_out(reg_cache, _jit, REG_LO);
+	else if (rd)
+		lo = rd;
+	else
+		lo = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+	if (!no_hi)
+		hi = lightrec_alloc_reg_out_ext(reg_cache, _jit, REG_HI);
+	else if (__WORDSIZE == 64)
+		hi = lightrec_alloc_reg_temp(reg_cache, _jit);
+
 #if __WORDSIZE == 32
 	/* On 32-bit systems, do a 32*32->64 bit operation, or a 32*32->32 bit
-	 * operation if the MULT was detected a 32-bit only. */
-	if (!(op->flags & LIGHTREC_MULT32)) {
+	 * operation if the upper word of the result is not used. */
+	if (!no_hi) {
 		if (is_signed)
 			jit_qmulr(lo, hi, rs, rt);
 		else
@@ -639,34 +689,255 @@ static void rec_alu_mult(const struct block *block,
 	if (is_signed) {
 		jit_mulr(lo, rs, rt);
 	} else {
-		jit_extr_ui(lo, rt);
+		/* lo may be the output register rd, which can alias rs or rt */
+		u8 tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+		jit_extr_ui(tmp, rt);
 		jit_extr_ui(hi, rs);
-		jit_mulr(lo, hi, lo);
+		jit_mulr(lo, hi, tmp);
+		lightrec_free_reg(reg_cache, tmp);
 	}
 
 	/* The 64-bit output value is in $lo, store the upper 32 bits in $hi */
-	if (!(op->flags & LIGHTREC_MULT32))
+	if (!no_hi)
 		jit_rshi(hi, lo, 32);
 #endif
 
+	if (rd && rd != lo)
+		jit_movr(rd, lo);
+
 	lightrec_free_reg(reg_cache, rs);
 	lightrec_free_reg(reg_cache, rt);
-	lightrec_free_reg(reg_cache, lo);
-	if (__WORDSIZE == 64 || !(op->flags & LIGHTREC_MULT32))
+	if (lo != rd)
+		lightrec_free_reg(reg_cache, lo);
+	if (rd)
+		lightrec_free_reg(reg_cache, rd);
+	if (__WORDSIZE == 64 || !no_hi)
 		lightrec_free_reg(reg_cache, hi);
 }
 
+/* Magic numbers for signed division by a constant, from Hacker's Delight */
+static void rec_div_magic_signed(s32 d, s32 *magic, u8 *shift)
+{
+	u32 ad = d < 0 ? -(u32)d : d;
+	u32 t = 0x80000000 + ((u32)d >> 31);
+	u32 anc = t - 1 - t % ad;
+	u32 q1 = 0x80000000 / anc, r1 = 0x80000000 - q1 * anc;
+	u32 q2 = 0x80000000 / ad, r2 = 0x80000000 - q2 * ad;
+	unsigned int p = 31;
+	u32 delta;
+
+	do {
+		p++;
+
+		q1 <<= 1;
+		r1 <<= 1;
+		if (r1 >= anc) {
+			q1++;
+			r1 -= anc;
+		}
+
+		q2 <<= 1;
+		r2 <<= 1;
+		if (r2 >= ad) {
+			q2++;
+			r2 -= ad;
+		}
+
+		delta = ad - r2;
+	} while (q1 < delta || (q1 == delta && r1 == 0));
+
+	*magic = d < 0 ? -(s32)(q2 + 1) : (s32)(q2 + 1);
+	*shift = p - 32;
+}
+
+/* dst = (x * magic) >> 32, for 32-bit values */
+static void rec_mulh_const(jit_state_t *_jit, u8 dst, u8 tmp, u8 x,
+			   u32 magic, bool is_signed)
+{
+#if __WORDSIZE == 32
+	if (is_signed)
+		jit_qmuli(tmp, dst, x, magic);
+	else
+		jit_qmuli_u(tmp, dst, x, magic);
+#else
+	/* The inputs are sign- or zero-extended, so the product fits */
+	if (is_signed) {
+		jit_muli(dst, x, (s32)magic);
+		jit_rshi(dst, dst, 32);
+	} else {
+		jit_muli(dst, x, magic);
+		jit_rshi_u(dst, dst, 32);
+	}
+#endif
+}
+
+static void rec_div_signed_const(jit_state_t *_jit, u8 lo, u8 hi,
+				 u8 rs, u8 tmp, s32 d, bool no_hi)
+{
+	u32 ad = d < 0 ? -(u32)d : d;
+	unsigned int k;
+	s32 magic;
+	u8 shift;
+
+	if (d == 1 || d == -1) {
+		/* 0x80000000 / -1 gives 0x80000000, like the hardware */
+		if (d == 1)
+			jit_movr(lo, rs);
+		else
+			jit_negr(lo, rs);
+		if (!no_hi)
+			jit_movi(hi, 0);
+	} else if (!(ad & (ad - 1))) {
+		k = __builtin_ctz(ad);
+
+		/* Round towards zero: add (2^k - 1) to negative dividends */
+		jit_rshi(tmp, rs, 31);
+		jit_andi(tmp, tmp, ad - 1);
+		jit_addr(tmp, tmp, rs);
+		jit_rshi(lo, tmp, k);
+
+		if (!no_hi) {
+			jit_lshi(tmp, lo, k);
+			jit_subr(hi, rs, tmp);
+		}
+
+		if (d < 0)
+			jit_negr(lo, lo);
+	} else {
+		rec_div_magic_signed(d, &magic, &shift);
+		rec_mulh_const(_jit, tmp, lo, rs, magic, true);
+
+		if (d > 0 && magic < 0)
+			jit_addr(tmp, tmp, rs);
+		else if (d < 0 && magic > 0)
+			jit_subr(tmp, tmp, rs);
+
+		if (shift)
+			jit_rshi(tmp, tmp, shift);
+
+		/* Add one to negative quotients */
+		jit_lti(hi, tmp, 0);
+		jit_addr(lo, tmp, hi);
+
+		if (!no_hi) {
+			jit_muli(tmp, lo, d);
+			jit_subr(hi, rs, tmp);
+		}
+	}
+}
+
+static void rec_div_unsigned_const(jit_state_t *_jit, u8 lo, u8 hi,
+				   u8 rs, u8 tmp, u32 d, bool no_lo, bool no_hi)
+{
+	unsigned int k, l;
+	u32 magic;
+
+#if __WORDSIZE == 64
+	/* Work on the zero-extended value of rs */
+	jit_extr_ui(hi, rs);
+	rs = hi;
+#endif
+
+	if (!(d & (d - 1))) {
+		k = __builtin_ctz(d);
+
+		if (!no_lo)
+			jit_rshi_u(lo, rs, k);
+		if (!no_hi)
+			jit_andi(hi, rs, d - 1);
+	} else {
+		/* q = (t + ((x - t) >> 1)) >> (l - 1), with t = mulhu(x, m) */
+		l = 32 - __builtin_clz(d);
+		magic = (u32)(((1ULL << 32) * ((1ULL << l) - d)) / d + 1);
+
+		rec_mulh_const(_jit, tmp, lo, rs, magic, false);
+		jit_subr(lo, rs, tmp);
+		jit_rshi_u(lo, lo, 1);
+		jit_addr(lo, lo, tmp);
+		jit_rshi_u(lo, lo, l - 1);
+
+		if (!no_hi) {
+			jit_muli(tmp, lo, d);
+			jit_subr(hi, rs, tmp);
+		}
+	}
+}
+
+/* Output register for HI or LO, or a temporary if the result is dead */
+static u8 rec_alloc_hilo(struct regcache *reg_cache, jit_state_t *_jit,
+			 u8 reg, bool dead)
+{
+	if (dead)
+		return lightrec_alloc_reg_temp(reg_cache, _jit);
+
+	return lightrec_alloc_reg_out(reg_cache, _jit, reg);
+}
+
+static void rec_alu_div_const(const struct block *block,
+			      const struct opcode *op, bool is_signed, u32 d)
+{
+	struct regcache *reg_cache = block->state->reg_cache;
+	jit_state_t *_jit = block->_jit;
+	bool no_lo = op->flags & LIGHTREC_NO_LO;
+	bool no_hi = op->flags & LIGHTREC_NO_HI;
+	u8 lo, hi, rs, tmp;
+
+	jit_note(__FILE__, __LINE__);
+	lo = rec_alloc_hilo(reg_cache, _jit, REG_LO, no_lo);
+	hi = rec_alloc_hilo(reg_cache, _jit, REG_HI, no_hi);
+
+	if (__WORDSIZE == 32 || !is_signed)
+		rs = lightrec_alloc_reg_in(reg_cache, _jit, op->r.rs);
+	else
+		rs = lightrec_alloc_reg_in_ext(reg_cache, _jit, op->r.rs);
+
+	tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+	if (!d) {
+		/* Division by zero doesn't trap on the R3000 */
+		if (is_signed) {
+			jit_lti(lo, rs, 0);
+			jit_lshi(lo, lo, 1);
+			jit_subi(lo, lo, 1);
+		} else {
+			jit_movi(lo, 0xffffffff);
+		}
+
+		jit_movr(hi, rs);
+	} else if (is_signed) {
+		rec_div_signed_const(_jit, lo, hi, rs, tmp, (s32)d, no_hi);
+	} else {
+		rec_div_unsigned_const(_jit, lo, hi, rs, tmp, d, no_lo, no_hi);
+	}
+
+	lightrec_free_reg(reg_cache, tmp);
+	lightrec_free_reg(reg_cache, rs);
+	lightrec_free_reg(reg_cache, lo);
+	lightrec_free_reg(reg_cache, hi);
+}
+
 static void rec_alu_div(const struct block *block,
 			const struct opcode *op, bool is_signed)
 {
-	struct regcache *reg_cache = block->state->reg_cache;
+	struct lightrec_state *state = block->state;
+	struct regcache *reg_cache = state->reg_cache;
 	jit_state_t *_jit = block->_jit;
 	jit_node_t *branch, *to_end;
-	u8 lo, hi, rs, rt;
+	bool no_lo = op->flags & LIGHTREC_NO_LO;
+	bool no_hi = op->flags & LIGHTREC_NO_HI;
+	u8 lo, hi, rs, rt, num, den;
+
+	/* Divisor known at compile time: no division, no zero check */
+	if (state->known_regs & BIT(op->r.rt)) {
+		rec_alu_div_const(block, op, is_signed,
+				  state->known_values[op->r.rt]);
+		return;
+	}
 
 	jit_note(__FILE__, __LINE__);
-	lo = lightrec_alloc_reg_out(reg_cache, _jit, REG_LO);
-	hi = lightrec_alloc_reg_out(reg_cache, _jit, REG_HI);
+	lo = rec_alloc_hilo(reg_cache, _jit, REG_LO, no_lo);
+	hi = rec_alloc_hilo(reg_cache, _jit, REG_HI, no_hi);
 
 	if (__WORDSIZE == 32 || !is_signed) {
 		rs = lightrec_alloc_reg_in(reg_cache, _jit, op->r.rs);
@@ -679,22 +950,39 @@ static void rec_alu_div(const struct block *block,
 	/* Jump to special handler if dividing by zero  */
 	branch = jit_beqi(rt, 0);
 
-#if __WORDSIZE == 32
-	if (is_signed)
-		jit_qdivr(lo, hi, rs, rt);
-	else
-		jit_qdivr_u(lo, hi, rs, rt);
-#else
-	/* On 64-bit systems, the input registers must be 32 bits, so we first sign-extend
-	 * (if div) or clear (if divu) the input registers. */
-	if (is_signed) {
-		jit_qdivr(lo, hi, rs, rt);
-	} else {
+#if __WORDSIZE == 64
+	/* On 64-bit systems, the input registers must be 32 bits, so we first
+	 * clear the upper bits of the input registers if divu; they are
+	 * already sign-extended if div. */
+	if (!is_signed) {
 		jit_extr_ui(lo, rt);
 		jit_extr_ui(hi, rs);
-		jit_qdivr_u(lo, hi, hi, lo);
-	}
+		num = hi;
+		den = lo;
+	} else
 #endif
+	{
+		num = rs;
+		den = rt;
+	}
+
+	/* Only compute the quotient or the remainder if the other is dead */
+	if (no_hi) {
+		if (is_signed)
+			jit_divr(lo, num, den);
+		else
+			jit_divr_u(lo, num, den);
+	} else if (no_lo) {
+		if (is_signed)
+			jit_remr(hi, num, den);
+		else
+			jit_remr_u(hi, num, den);
+	} else {
+		if (is_signed)
+			jit_qdivr(lo, hi, num, den);
+		else
+			jit_qdivr_u(lo, hi, num, den);
+	}
 
 	/* Jump above the div-by-zero handler */
 	to_end = jit_jmpi();
@@ -794,28 +1082,57 @@ static void rec_special_MTLO(const struct block *block,
 	rec_alu_mv_lo_hi(block, REG_LO, op->r.rs);
 }
 
-static void rec_io(const struct block *block, const struct opcode *op,
-		   bool load_rt, bool read_rt)
+static void rec_c_call_enter(const struct block *block, bool sync_cycles)
 {
 	struct regcache *reg_cache = block->state->reg_cache;
 	jit_state_t *_jit = block->_jit;
-	bool is_tagged = op->flags & (LIGHTREC_HW_IO | LIGHTREC_DIRECT_IO);
-	u32 offset;
-	u8 tmp, tmp2, tmp3;
+	unsigned int i;
 
-	jit_note(__FILE__, __LINE__);
+	/* The handler will clobber the caller-saved registers */
+	for (i = 0; i < NUM_TEMPS; i++)
+		lightrec_alloc_reg(reg_cache, _jit, JIT_R(i));
 
-	tmp = lightrec_alloc_reg(reg_cache, _jit, JIT_R0);
+	if (!sync_cycles)
+		return;
 
-	if (is_tagged) {
-		offset = offsetof(struct lightrec_state, rw_func);
-	} else {
-		tmp3 = lightrec_alloc_reg(reg_cache, _jit, JIT_R1);
-		offset = offsetof(struct lightrec_state, rw_generic_func);
+	/* Update the cycle counter, as the handler may read it */
+	jit_ldxi_i(JIT_R0, LIGHTREC_REG_STATE,
+		   offsetof(struct lightrec_state, target_cycle));
+	jit_subr(JIT_R0, JIT_R0, LIGHTREC_REG_CYCLE);
+	jit_stxi_i(offsetof(struct lightrec_state, current_cycle),
+		   LIGHTREC_REG_STATE, JIT_R0);
+}
+
+static void rec_c_call_leave(const struct block *block, bool sync_cycles)
+{
+	struct regcache *reg_cache = block->state->reg_cache;
+	jit_state_t *_jit = block->_jit;
+	unsigned int i;
+
+	if (sync_cycles) {
+		/* The handler may have modified the cycle counters */
+		jit_ldxi_i(LIGHTREC_REG_CYCLE, LIGHTREC_REG_STATE,
+			   offsetof(struct lightrec_state, target_cycle));
+		jit_ldxi_i(JIT_R0, LIGHTREC_REG_STATE,
+			   offsetof(struct lightrec_state, current_cycle));
+		jit_subr(LIGHTREC_REG_CYCLE, LIGHTREC_REG_CYCLE, JIT_R0);
+#if __WORDSIZE == 64
+		jit_extr_i(LIGHTREC_REG_CYCLE, LIGHTREC_REG_CYCLE);
+#endif
 	}
 
-	tmp2 = lightrec_alloc_reg_temp(reg_cache, _jit);
-	jit_ldxi(tmp2, LIGHTREC_REG_STATE, offset);
+	for (i = 0; i < NUM_TEMPS; i++)
+		lightrec_free_reg(reg_cache, JIT_R(i));
+
+	lightrec_regcache_mark_live(reg_cache, _jit);
+}
+
+static void rec_io_clean_regs(const struct block *block,
+			      const struct opcode *op,
+			      bool load_rt, bool read_rt)
+{
+	struct regcache *reg_cache = block->state->reg_cache;
+	jit_state_t *_jit = block->_jit;
 
 	lightrec_clean_reg_if_loaded(reg_cache, _jit, op->i.rs, false);
 
@@ -823,107 +1140,585 @@ static void rec_io(const struct block *block, const struct opcode *op,
 		lightrec_clean_reg_if_loaded(reg_cache, _jit, op->i.rt, true);
 	else if (load_rt)
 		lightrec_clean_reg_if_loaded(reg_cache, _jit, op->i.rt, false);
+}
 
-	if (is_tagged) {
-		jit_movi(tmp, op->opcode);
-	} else {
-		jit_movi(tmp, (uintptr_t)op);
-		jit_movi(tmp3, (uintptr_t)block);
+static void rec_io(const struct block *block, const struct opcode *op,
+		   bool load_rt, bool read_rt)
+{
+	struct regcache *reg_cache = block->state->reg_cache;
+	jit_state_t *_jit = block->_jit;
+	u8 tmp, tmp2, tmp3;
+
+	jit_note(__FILE__, __LINE__);
+
+	if (op->flags & (LIGHTREC_HW_IO | LIGHTREC_DIRECT_IO)) {
+		/* Tagged opcodes don't need the wrapper; call the C callback
+		 * directly, after syncing only the registers it accesses */
+		rec_c_call_enter(block, true);
+		rec_io_clean_regs(block, op, load_rt, read_rt);
+
+		jit_prepare();
+		jit_pushargr(LIGHTREC_REG_STATE);
+		jit_pushargi(op->opcode);
+		jit_finishi(lightrec_rw_cb);
+
+		rec_c_call_leave(block, true);
+		return;
 	}
 
+	tmp = lightrec_alloc_reg(reg_cache, _jit, JIT_R0);
+	tmp3 = lightrec_alloc_reg(reg_cache, _jit, JIT_R1);
+	tmp2 = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+	jit_ldxi(tmp2, LIGHTREC_REG_STATE,
+		 offsetof(struct lightrec_state, rw_generic_func));
+
+	rec_io_clean_regs(block, op, load_rt, read_rt);
+
+	jit_movi(tmp, (uintptr_t)op);
+	jit_movi(tmp3, (uintptr_t)block);
+
 	jit_callr(tmp2);
 
 	lightrec_free_reg(reg_cache, tmp);
 	lightrec_free_reg(reg_cache, tmp2);
-	if (!is_tagged)
-		lightrec_free_reg(reg_cache, tmp3);
+	lightrec_free_reg(reg_cache, tmp3);
 	lightrec_regcache_mark_live(reg_cache, _jit);
 }
 
-static void rec_store_direct_no_invalidate(const struct block *block,
-					   const struct opcode *op,
-					   jit_code_t code)
+static void * get_io_handler(const struct block *block,
+			     const struct opcode *op, jit_code_t code, u32 *addr)
 {
 	struct lightrec_state *state = block->state;
-	struct regcache *reg_cache = state->reg_cache;
+	const struct lightrec_mem_map_ops *ops;
+	unsigned int i;
+	u32 kaddr;
+
+	if (!(state->known_regs & BIT(op->i.rs)))
+		return NULL;
+
+	*addr = state->known_values[op->i.rs] + (s16)op->i.imm;
+	kaddr = kunseg(*addr);
+
+	for (i = 0; i < state->nb_io_handlers; i++) {
+		if (kaddr < state->io_handlers[i].addr ||
+		    kaddr >= state->io_handlers[i].addr +
+		    state->io_handlers[i].length)
+			continue;
+
+		ops = state->io_handlers[i].ops;
+
+		switch (code) {
+		case jit_code_stxi_c:
+			return ops->sb;
+		case jit_code_stxi_s:
+			return ops->sh;
+		case jit_code_stxi_i:
+			return ops->sw;
+		case jit_code_ldxi_c:
+		case jit_code_ldxi_uc:
+			return ops->lb;
+		case jit_code_ldxi_s:
+		case jit_code_ldxi_us:
+			return ops->lh;
+		case jit_code_ldxi_i:
+			return ops->lw;
+		default:
+			return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+static void rec_io_handler(const struct block *block, const struct opcode *op,
+			   jit_code_t code, void *fn, u32 addr, bool is_store)
+{
+	struct regcache *reg_cache = block->state->reg_cache;
 	jit_state_t *_jit = block->_jit;
-	jit_node_t *to_not_ram, *to_end;
-	u8 tmp, tmp2, rs, rt;
-	s16 imm;
+	u8 rt;
 
 	jit_note(__FILE__, __LINE__);
-	rs = lightrec_alloc_reg_in(reg_cache, _jit, op->i.rs);
-	tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
-	tmp2 = lightrec_alloc_reg_temp(reg_cache, _jit);
-
-	/* Convert to KUNSEG and avoid RAM mirrors */
-	if (state->mirrors_mapped) {
-		imm = (s16)op->i.imm;
-		jit_andi(tmp, rs, 0x1f800000 | (4 * RAM_SIZE - 1));
-	} else if (op->i.imm) {
-		imm = 0;
-		jit_addi(tmp, rs, (s16)op->i.imm);
-		jit_andi(tmp, tmp, 0x1f800000 | (RAM_SIZE - 1));
-	} else {
-		imm = 0;
-		jit_andi(tmp, rs, 0x1f800000 | (RAM_SIZE - 1));
-	}
+	rec_c_call_enter(block, true);
 
-	lightrec_free_reg(reg_cache, rs);
+	if (is_store) {
+		rt = lightrec_alloc_reg_in(reg_cache, _jit, op->i.rt);
 
-	if (state->offset_ram != state->offset_scratch) {
-		to_not_ram = jit_bmsi(tmp, BIT(28));
+		if (code == jit_code_stxi_c)
+			jit_extr_uc(JIT_R0, rt);
+		else if (code == jit_code_stxi_s)
+			jit_extr_us(JIT_R0, rt);
+		else
+			jit_movr(JIT_R0, rt);
 
-		jit_movi(tmp2, state->offset_ram);
+		lightrec_free_reg(reg_cache, rt);
+	}
 
-		to_end = jit_jmpi();
-		jit_patch(to_not_ram);
+	jit_prepare();
+	jit_pushargr(LIGHTREC_REG_STATE);
+	jit_pushargi(addr);
+	if (is_store)
+		jit_pushargr(JIT_R0);
+	jit_finishi(fn);
+
+	if (!is_store && op->i.rt) {
+		rt = lightrec_alloc_reg_out_ext(reg_cache, _jit, op->i.rt);
+
+		switch (code) {
+		case jit_code_ldxi_c:
+			jit_retval_c(rt);
+			break;
+		case jit_code_ldxi_uc:
+			jit_retval_uc(rt);
+			break;
+		case jit_code_ldxi_s:
+			jit_retval_s(rt);
+			break;
+		case jit_code_ldxi_us:
+			jit_retval_us(rt);
+			break;
+		default:
+#if __WORDSIZE == 64
+			jit_retval_i(rt);
+#else
+			jit_retval(rt);
+#endif
+			break;
+		}
 
-		jit_movi(tmp2, state->offset_scratch);
-		jit_patch(to_end);
-	} else if (state->offset_ram) {
-		jit_movi(tmp2, state->offset_ram);
+		lightrec_free_reg(reg_cache, rt);
 	}
 
-	if (state->offset_ram || state->offset_scratch)
-		jit_addr(tmp, tmp, tmp2);
+	rec_c_call_leave(block, true);
+}
 
-	lightrec_free_reg(reg_cache, tmp2);
+static const struct lightrec_mem_map_ops *
+get_batch_ops(const struct block *block, const struct opcode *op, u32 *addr)
+{
+	struct lightrec_state *state = block->state;
+	const struct lightrec_mem_map *map;
 
-	rt = lightrec_alloc_reg_in(reg_cache, _jit, op->i.rt);
-	jit_new_node_www(code, imm, tmp, rt);
+	if (!(state->known_regs & BIT(op->i.rs)))
+		return NULL;
 
-	lightrec_free_reg(reg_cache, rt);
-	lightrec_free_reg(reg_cache, tmp);
+	*addr = state->known_values[op->i.rs] + (s16)op->i.imm;
+
+	map = lightrec_get_map(state, kunseg(*addr));
+	if (!map || !map->ops || !map->ops->sw_batch)
+		return NULL;
+
+	return map->ops;
 }
 
-static void rec_store_direct(const struct block *block, const struct opcode *op,
-			     jit_code_t code)
+static bool rec_store_batch(const struct block *block, const struct opcode *op)
 {
 	struct lightrec_state *state = block->state;
 	struct regcache *reg_cache = state->reg_cache;
+	const struct lightrec_mem_map_ops *ops;
 	jit_state_t *_jit = block->_jit;
-	jit_node_t *to_not_ram, *to_end;
-	u8 tmp, tmp2, tmp3, rs, rt;
+	const struct opcode *elm;
+	unsigned int i, count;
+	u32 addr;
+	u8 rt;
 
-	jit_note(__FILE__, __LINE__);
+	ops = get_batch_ops(block, op, &addr);
+	if (!ops)
+		return false;
 
-	rs = lightrec_alloc_reg_in(reg_cache, _jit, op->i.rs);
-	tmp2 = lightrec_alloc_reg_temp(reg_cache, _jit);
-	tmp3 = lightrec_alloc_reg_in(reg_cache, _jit, 0);
+	for (count = 1, elm = op->next;
+	     count < MAX_IO_BATCH && elm && (elm->flags & LIGHTREC_BATCHED) &&
+	     get_batch_ops(block, elm, &addr) == ops;
+	     count++, elm = elm->next);
 
-	/* Convert to KUNSEG and avoid RAM mirrors */
-	if (op->i.imm) {
-		jit_addi(tmp2, rs, (s16)op->i.imm);
-		jit_andi(tmp2, tmp2, 0x1f800000 | (RAM_SIZE - 1));
-	} else {
-		jit_andi(tmp2, rs, 0x1f800000 | (RAM_SIZE - 1));
-	}
+	if (count == 1)
+		return false;
 
-	lightrec_free_reg(reg_cache, rs);
-	tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
+	pr_debug("Emitting batch of %u HW writes\n", count);
 
-	to_not_ram = jit_bgti(tmp2, RAM_SIZE);
+	jit_note(__FILE__, __LINE__);
+	rec_c_call_enter(block, true);
+
+	for (i = 0, elm = op; i < count; i++, elm = elm->next) {
+		get_batch_ops(block, elm, &addr);
+
+		jit_movi(JIT_R0, addr);
+		jit_stxi_i(offsetof(struct lightrec_state, io_batch[i].addr),
+			   LIGHTREC_REG_STATE, JIT_R0);
+
+		rt = lightrec_alloc_reg_in(reg_cache, _jit, elm->i.rt);
+		jit_stxi_i(offsetof(struct lightrec_state, io_batch[i].data),
+			   LIGHTREC_REG_STATE, rt);
+		lightrec_free_reg(reg_cache, rt);
+	}
+
+	jit_addi(JIT_R0, LIGHTREC_REG_STATE,
+		 offsetof(struct lightrec_state, io_batch));
+
+	jit_prepare();
+	jit_pushargr(LIGHTREC_REG_STATE);
+	jit_pushargr(JIT_R0);
+	jit_pushargi(count);
+	jit_finishi(ops->sw_batch);
+
+	rec_c_call_leave(block, true);
+
+	/* The following stores have been handled */
+	state->nb_batched = count - 1;
+
+	return true;
+}
+
+/* Convert the emulated address in addr_reg to a host address in dst, which
+ * can be the same register */
+static void rec_host_address(const struct block *block,
+			     u8 dst, u8 addr_reg, u8 tmp)
+{
+	struct lightrec_state *state = block->state;
+	jit_state_t *_jit = block->_jit;
+	jit_node_t *to_not_ram, *to_not_bios, *to_end, *to_end2;
+
+	if (state->offset_ram == state->offset_bios &&
+	    state->offset_ram == state->offset_scratch) {
+		if (!state->mirrors_mapped) {
+			jit_andi(tmp, addr_reg, BIT(28));
+			jit_rshi_u(tmp, tmp, 28 - 22);
+			jit_ori(tmp, tmp, 0x1f800000 | (RAM_SIZE - 1));
+			jit_andr(dst, addr_reg, tmp);
+		} else {
+			jit_andi(dst, addr_reg, 0x1fffffff);
+		}
+
+		if (state->offset_ram)
+			jit_movi(tmp, state->offset_ram);
+	} else {
+		to_not_ram = jit_bmsi(addr_reg, BIT(28));
+
+		/* Convert to KUNSEG and avoid RAM mirrors */
+		jit_andi(dst, addr_reg, RAM_SIZE - 1);
+
+		if (state->offset_ram)
+			jit_movi(tmp, state->offset_ram);
+
+		to_end = jit_jmpi();
+
+		jit_patch(to_not_ram);
+
+		if (state->offset_bios != state->offset_scratch)
+			to_not_bios = jit_bmci(addr_reg, BIT(22));
+
+		/* Convert to KUNSEG */
+		jit_andi(dst, addr_reg, 0x1fc00000 | (BIOS_SIZE - 1));
+
+		jit_movi(tmp, state->offset_bios);
+
+		if (state->offset_bios != state->offset_scratch) {
+			to_end2 = jit_jmpi();
+
+			jit_patch(to_not_bios);
+
+			/* Convert to KUNSEG */
+			jit_andi(dst, addr_reg, 0x1f800fff);
+
+			if (state->offset_scratch)
+				jit_movi(tmp, state->offset_scratch);
+
+			jit_patch(to_end2);
+		}
+
+		jit_patch(to_end);
+	}
+
+	if (state->offset_ram || state->offset_bios || state->offset_scratch)
+		jit_addr(dst, dst, tmp);
+}
+
+static jit_code_t rec_io_code(union code c)
+{
+	switch (c.i.op) {
+	case OP_LB:
+		return jit_code_ldxi_c;
+	case OP_LBU:
+		return jit_code_ldxi_uc;
+	case OP_LH:
+		return jit_code_ldxi_s;
+	case OP_LHU:
+		return jit_code_ldxi_us;
+	case OP_LW:
+		return jit_code_ldxi_i;
+	case OP_SB:
+		return jit_code_stxi_c;
+	case OP_SH:
+		return jit_code_stxi_s;
+	default:
+		return jit_code_stxi_i;
+	}
+}
+
+static bool rec_io_is_direct(const struct block *block,
+				const struct opcode *op)
+{
+	const struct lightrec_state *state = block->state;
+
+	if ((op->flags & (LIGHTREC_DIRECT_IO | LIGHTREC_HW_IO |
+			  LIGHTREC_BATCHED)) != LIGHTREC_DIRECT_IO)
+		return false;
+
+	switch (op->i.op) {
+	case OP_SB:
+	case OP_SH:
+	case OP_SW:
+		/* Only stores that don't need to invalidate code */
+		return (op->flags & LIGHTREC_NO_INVALIDATE) ||
+			state->invalidate_from_dma_only || state->pageprot;
+	default:
+		return true;
+	}
+}
+
+/* Host address of $sp, cached in the state along with the value of $sp it
+ * was computed for. It is recomputed on a mismatch, so writes to $sp
+ * don't need to be tracked. */
+static u8 rec_sp_address(const struct block *block)
+{
+	struct regcache *reg_cache = block->state->reg_cache;
+	jit_state_t *_jit = block->_jit;
+	jit_node_t *hit, *to_end;
+	u8 sp, host, tmp;
+
+	sp = lightrec_alloc_reg_in_ext(reg_cache, _jit, 29);
+	host = lightrec_alloc_reg_temp(reg_cache, _jit);
+	tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+	jit_ldxi_i(host, LIGHTREC_REG_STATE,
+		   offsetof(struct lightrec_state, sp_tag));
+	hit = jit_beqr(host, sp);
+
+	rec_host_address(block, host, sp, tmp);
+	jit_stxi_i(offsetof(struct lightrec_state, sp_tag),
+		   LIGHTREC_REG_STATE, sp);
+	jit_stxi(offsetof(struct lightrec_state, sp_host),
+		 LIGHTREC_REG_STATE, host);
+	to_end = jit_jmpi();
+
+	jit_patch(hit);
+	jit_ldxi(host, LIGHTREC_REG_STATE,
+		 offsetof(struct lightrec_state, sp_host));
+	jit_patch(to_end);
+
+	lightrec_free_reg(reg_cache, tmp);
+	lightrec_free_reg(reg_cache, sp);
+
+	return host;
+}
+
+static bool rec_sp_access(const struct block *block, const struct opcode *op)
+{
+	struct regcache *reg_cache = block->state->reg_cache;
+	jit_state_t *_jit = block->_jit;
+	u8 host, rt;
+
+	/* The offset is added to the host address of $sp, which only wraps
+	 * around at the end of the RAM if the mirrors are mapped. Negative
+	 * offsets could point before the start of the mapping, as $sp itself
+	 * can be masked to the start of the RAM. */
+	if (!ENABLE_SP_CACHE || op->i.rs != 29 || (s16)op->i.imm < 0 ||
+	    !block->state->mirrors_mapped || !rec_io_is_direct(block, op))
+		return false;
+
+	jit_note(__FILE__, __LINE__);
+
+	switch (op->i.op) {
+	case OP_SB:
+	case OP_SH:
+	case OP_SW:
+		host = rec_sp_address(block);
+		rt = lightrec_alloc_reg_in(reg_cache, _jit, op->i.rt);
+		jit_new_node_www(rec_io_code(op->c), (s16)op->i.imm, host, rt);
+		break;
+	default:
+		if (!op->i.rt)
+			return true;
+
+		host = rec_sp_address(block);
+		rt = lightrec_alloc_reg_out_ext(reg_cache, _jit, op->i.rt);
+		jit_new_node_www(rec_io_code(op->c), rt, host, (s16)op->i.imm);
+		break;
+	}
+
+	lightrec_free_reg(reg_cache, rt);
+	lightrec_free_reg(reg_cache, host);
+
+	return true;
+}
+
+static const struct opcode * rec_io_next(const struct opcode *op)
+{
+	for (op = op->next; op && op->i.op == OP_META_REG_UNLOAD;
+	     op = op->next);
+
+	return op;
+}
+
+/* Emit a run of loads/stores flagged LIGHTREC_COALESCED as a whole,
+ * translating the address of the base register only once. */
+static bool rec_io_coalesce(const struct block *block,
+			    const struct opcode *op)
+{
+	struct lightrec_state *state = block->state;
+	struct regcache *reg_cache = state->reg_cache;
+	jit_state_t *_jit = block->_jit;
+	const struct opcode *elm;
+	unsigned int i, count;
+	s16 imm = (s16)op->i.imm;
+	u8 rs, rt, base, tmp;
+
+	/* Without the mirrors mapped, the host addresses of the run don't wrap
+	 * around at the end of the RAM like the emulated addresses do */
+	if (!state->mirrors_mapped)
+		return false;
+
+	for (count = 0, elm = op; elm && rec_io_is_direct(block, elm);
+	     count++, elm = rec_io_next(elm)) {
+		if (count && !(elm->flags & LIGHTREC_COALESCED))
+			break;
+
+		/* Use the lowest address of the run as the base: the host
+		 * address is masked to the RAM size, and the offsets must not
+		 * point before the start of the mapping */
+		if ((s16)elm->i.imm < imm)
+			imm = (s16)elm->i.imm;
+	}
+
+	if (count < 2)
+		return false;
+
+	pr_debug("Emitting run of %u loads/stores\n", count);
+
+	jit_note(__FILE__, __LINE__);
+	rs = lightrec_alloc_reg_in(reg_cache, _jit, op->i.rs);
+	base = lightrec_alloc_reg_temp(reg_cache, _jit);
+	tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+	jit_addi(base, rs, imm);
+	lightrec_free_reg(reg_cache, rs);
+
+	rec_host_address(block, base, base, tmp);
+	lightrec_free_reg(reg_cache, tmp);
+
+	for (i = 0, elm = op; i < count; i++, elm = rec_io_next(elm)) {
+		switch (elm->i.op) {
+		case OP_SB:
+		case OP_SH:
+		case OP_SW:
+			rt = lightrec_alloc_reg_in(reg_cache, _jit, elm->i.rt);
+			jit_new_node_www(rec_io_code(elm->c),
+					 (s16)elm->i.imm - imm, base, rt);
+			break;
+		default:
+			if (!elm->i.rt)
+				continue;
+
+			rt = lightrec_alloc_reg_out_ext(reg_cache, _jit,
+							elm->i.rt);
+			jit_new_node_www(rec_io_code(elm->c), rt, base,
+					 (s16)elm->i.imm - imm);
+			break;
+		}
+
+		lightrec_free_reg(reg_cache, rt);
+	}
+
+	lightrec_free_reg(reg_cache, base);
+
+	state->nb_coalesced = count - 1;
+
+	return true;
+}
+
+static void rec_store_direct_no_invalidate(const struct block *block,
+					   const struct opcode *op,
+					   jit_code_t code)
+{
+	struct lightrec_state *state = block->state;
+	struct regcache *reg_cache = state->reg_cache;
+	jit_state_t *_jit = block->_jit;
+	jit_node_t *to_not_ram, *to_end;
+	u8 tmp, tmp2, rs, rt;
+	s16 imm;
+
+	jit_note(__FILE__, __LINE__);
+	rs = lightrec_alloc_reg_in(reg_cache, _jit, op->i.rs);
+	tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
+	tmp2 = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+	/* Convert to KUNSEG and avoid RAM mirrors */
+	if (state->mirrors_mapped) {
+		imm = (s16)op->i.imm;
+		jit_andi(tmp, rs, 0x1f800000 | (4 * RAM_SIZE - 1));
+	} else if (op->i.imm) {
+		imm = 0;
+		jit_addi(tmp, rs, (s16)op->i.imm);
+		jit_andi(tmp, tmp, 0x1f800000 | (RAM_SIZE - 1));
+	} else {
+		imm = 0;
+		jit_andi(tmp, rs, 0x1f800000 | (RAM_SIZE - 1));
+	}
+
+	lightrec_free_reg(reg_cache, rs);
+
+	if (state->offset_ram != state->offset_scratch) {
+		to_not_ram = jit_bmsi(tmp, BIT(28));
+
+		jit_movi(tmp2, state->offset_ram);
+
+		to_end = jit_jmpi();
+		jit_patch(to_not_ram);
+
+		jit_movi(tmp2, state->offset_scratch);
+		jit_patch(to_end);
+	} else if (state->offset_ram) {
+		jit_movi(tmp2, state->offset_ram);
+	}
+
+	if (state->offset_ram || state->offset_scratch)
+		jit_addr(tmp, tmp, tmp2);
+
+	lightrec_free_reg(reg_cache, tmp2);
+
+	rt = lightrec_alloc_reg_in(reg_cache, _jit, op->i.rt);
+	jit_new_node_www(code, imm, tmp, rt);
+
+	lightrec_free_reg(reg_cache, rt);
+	lightrec_free_reg(reg_cache, tmp);
+}
+
+static void rec_store_direct(const struct block *block, const struct opcode *op,
+			     jit_code_t code)
+{
+	struct lightrec_state *state = block->state;
+	struct regcache *reg_cache = state->reg_cache;
+	jit_state_t *_jit = block->_jit;
+	jit_node_t *to_not_ram, *to_end;
+	u8 tmp, tmp2, tmp3, rs, rt;
+
+	jit_note(__FILE__, __LINE__);
+
+	rs = lightrec_alloc_reg_in(reg_cache, _jit, op->i.rs);
+	tmp2 = lightrec_alloc_reg_temp(reg_cache, _jit);
+	tmp3 = lightrec_alloc_reg_in(reg_cache, _jit, 0);
+
+	/* Convert to KUNSEG and avoid RAM mirrors */
+	if (op->i.imm) {
+		jit_addi(tmp2, rs, (s16)op->i.imm);
+		jit_andi(tmp2, tmp2, 0x1f800000 | (RAM_SIZE - 1));
+	} else {
+		jit_andi(tmp2, rs, 0x1f800000 | (RAM_SIZE - 1));
+	}
+
+	lightrec_free_reg(reg_cache, rs);
+	tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+	to_not_ram = jit_bgti(tmp2, RAM_SIZE);
 
 	/* Compute the offset to the code LUT */
 	jit_andi(tmp, tmp2, (RAM_SIZE - 1) & ~3);
@@ -965,10 +1760,31 @@ static void rec_store_direct(const struct block *block, const struct opcode *op,
 static void rec_store(const struct block *block, const struct opcode *op,
 		     jit_code_t code)
 {
-	if (op->flags & LIGHTREC_NO_INVALIDATE) {
+	struct lightrec_state *state = block->state;
+	void *fn;
+	u32 addr;
+
+	if ((op->flags & LIGHTREC_COALESCED) && state->nb_coalesced) {
+		state->nb_coalesced--;
+		return;
+	}
+
+	if (rec_io_next(op) && (rec_io_next(op)->flags & LIGHTREC_COALESCED) &&
+	    rec_io_coalesce(block, op))
+		return;
+
+	if (rec_sp_access(block, op))
+		return;
+
+	fn = get_io_handler(block, op, code, &addr);
+	if (fn) {
+		rec_io_handler(block, op, code, fn, addr, true);
+	} else if (op->flags & LIGHTREC_NO_INVALIDATE) {
 		rec_store_direct_no_invalidate(block, op, code);
 	} else if (op->flags & LIGHTREC_DIRECT_IO) {
-		if (block->state->invalidate_from_dma_only)
+		/* With page protection, writes to code pages will fault */
+		if (block->state->invalidate_from_dma_only ||
+		    block->state->pageprot)
 			rec_store_direct_no_invalidate(block, op, code);
 		else
 			rec_store_direct(block, op, code);
@@ -991,20 +1807,20 @@ static void rec_SH(const struct block *block, const struct opcode *op, u32 pc)
 
 static void rec_SW(const struct block *block, const struct opcode *op, u32 pc)
 {
-	_jit_name(block->_jit, __func__);
-	rec_store(block, op, jit_code_stxi_i);
-}
+	struct lightrec_state *state = block->state;
 
-static void rec_SWL(const struct block *block, const struct opcode *op, u32 pc)
-{
 	_jit_name(block->_jit, __func__);
-	rec_io(block, op, true, false);
-}
 
-static void rec_SWR(const struct block *block, const struct opcode *op, u32 pc)
-{
-	_jit_name(block->_jit, __func__);
-	rec_io(block, op, true, false);
+	if ((op->flags & LIGHTREC_BATCHED) && state->nb_batched) {
+		state->nb_batched--;
+		return;
+	}
+
+	if (op->next && (op->next->flags & LIGHTREC_BATCHED) &&
+	    rec_store_batch(block, op))
+		return;
+
+	rec_store(block, op, jit_code_stxi_i);
 }
 
 static void rec_SWC2(const struct block *block, const struct opcode *op, u32 pc)
@@ -1019,7 +1835,6 @@ static void rec_load_direct(const struct block *block, const struct opcode *op,
 	struct lightrec_state *state = block->state;
 	struct regcache *reg_cache = state->reg_cache;
 	jit_state_t *_jit = block->_jit;
-	jit_node_t *to_not_ram, *to_not_bios, *to_end, *to_end2;
 	u8 tmp, rs, rt, addr_reg;
 	s16 imm;
 
@@ -1046,74 +1861,98 @@ static void rec_load_direct(const struct block *block, const struct opcode *op,
 
 	tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
 
-	if (state->offset_ram == state->offset_bios &&
-	    state->offset_ram == state->offset_scratch) {
-		if (!state->mirrors_mapped) {
-			jit_andi(tmp, addr_reg, BIT(28));
-			jit_rshi_u(tmp, tmp, 28 - 22);
-			jit_ori(tmp, tmp, 0x1f800000 | (RAM_SIZE - 1));
-			jit_andr(rt, addr_reg, tmp);
-		} else {
-			jit_andi(rt, addr_reg, 0x1fffffff);
-		}
+	rec_host_address(block, rt, addr_reg, tmp);
 
-		if (state->offset_ram)
-			jit_movi(tmp, state->offset_ram);
-	} else {
-		to_not_ram = jit_bmsi(addr_reg, BIT(28));
+	jit_new_node_www(code, rt, rt, imm);
 
-		/* Convert to KUNSEG and avoid RAM mirrors */
-		jit_andi(rt, addr_reg, RAM_SIZE - 1);
+	lightrec_free_reg(reg_cache, addr_reg);
+	lightrec_free_reg(reg_cache, rt);
+	lightrec_free_reg(reg_cache, tmp);
+}
 
-		if (state->offset_ram)
-			jit_movi(tmp, state->offset_ram);
+static void rec_load(const struct block *block, const struct opcode *op,
+		    jit_code_t code)
+{
+	struct lightrec_state *state = block->state;
+	void *fn;
+	u32 addr;
 
-		to_end = jit_jmpi();
+	if ((op->flags & LIGHTREC_COALESCED) && state->nb_coalesced) {
+		state->nb_coalesced--;
+		return;
+	}
 
-		jit_patch(to_not_ram);
+	if (rec_io_next(op) && (rec_io_next(op)->flags & LIGHTREC_COALESCED) &&
+	    rec_io_coalesce(block, op))
+		return;
 
-		if (state->offset_bios != state->offset_scratch)
-			to_not_bios = jit_bmci(addr_reg, BIT(22));
+	if (rec_sp_access(block, op))
+		return;
 
-		/* Convert to KUNSEG */
-		jit_andi(rt, addr_reg, 0x1fc00000 | (BIOS_SIZE - 1));
+	fn = get_io_handler(block, op, code, &addr);
+	if (fn)
+		rec_io_handler(block, op, code, fn, addr, false);
+	else if (op->flags & LIGHTREC_DIRECT_IO)
+		rec_load_direct(block, op, code);
+	else
+		rec_io(block, op, false, true);
+}
 
-		jit_movi(tmp, state->offset_bios);
+/* Emit a LWL/LWR or SWL/SWR pair flagged by the optimizer as a single
+ * unaligned native access, if both opcodes access RAM or scratchpad. */
+static bool rec_unaligned_pair(const struct block *block,
+			       const struct opcode *op, bool is_store)
+{
+	struct lightrec_state *state = block->state;
+	const struct opcode *next = op->next;
+	struct opcode word_op;
 
-		if (state->offset_bios != state->offset_scratch) {
-			to_end2 = jit_jmpi();
+	if (state->pair_merged) {
+		/* Second opcode of a pair already emitted */
+		state->pair_merged = false;
+		return true;
+	}
 
-			jit_patch(to_not_bios);
+	/* Without mirrors, an access to the last bytes of RAM would overflow
+	 * the buffer instead of wrapping */
+	if (!HAS_UNALIGNED_ACCESS || !state->mirrors_mapped ||
+	    !(op->flags & LIGHTREC_UNALIGNED_PAIR) ||
+	    !(op->flags & next->flags & LIGHTREC_DIRECT_IO))
+		return false;
 
-			/* Convert to KUNSEG */
-			jit_andi(rt, addr_reg, 0x1f800fff);
+	/* The code LUT would need to be invalidated for two words */
+	if (is_store && !(op->flags & LIGHTREC_NO_INVALIDATE) &&
+	    !state->invalidate_from_dma_only && !state->pageprot)
+		return false;
 
-			if (state->offset_scratch)
-				jit_movi(tmp, state->offset_scratch);
+	/* Equivalent LW/SW at the address of the LWR/SWR */
+	word_op = (op->i.op == OP_LWR || op->i.op == OP_SWR) ? *op : *next;
+	word_op.i.op = is_store ? OP_SW : OP_LW;
 
-			jit_patch(to_end2);
-		}
+	if (is_store)
+		rec_store_direct_no_invalidate(block, &word_op, jit_code_stxi_i);
+	else
+		rec_load_direct(block, &word_op, jit_code_ldxi_i);
 
-		jit_patch(to_end);
-	}
+	state->pair_merged = true;
 
-	if (state->offset_ram || state->offset_bios || state->offset_scratch)
-		jit_addr(rt, rt, tmp);
+	return true;
+}
 
-	jit_new_node_www(code, rt, rt, imm);
+static void rec_SWL(const struct block *block, const struct opcode *op, u32 pc)
+{
+	_jit_name(block->_jit, __func__);
 
-	lightrec_free_reg(reg_cache, addr_reg);
-	lightrec_free_reg(reg_cache, rt);
-	lightrec_free_reg(reg_cache, tmp);
+	if (!rec_unaligned_pair(block, op, true))
+		rec_io(block, op, true, false);
 }
 
-static void rec_load(const struct block *block, const struct opcode *op,
-		    jit_code_t code)
+static void rec_SWR(const struct block *block, const struct opcode *op, u32 pc)
 {
-	if (op->flags & LIGHTREC_DIRECT_IO)
-		rec_load_direct(block, op, code);
-	else
-		rec_io(block, op, false, true);
+	_jit_name(block->_jit, __func__);
+
+	if (!rec_unaligned_pair(block, op, true))
+		rec_io(block, op, true, false);
 }
 
 static void rec_LB(const struct block *block, const struct opcode *op, u32 pc)
@@ -1143,13 +1982,17 @@ static void rec_LHU(const struct block *block, const struct opcode *op, u32 pc)
 static void rec_LWL(const struct block *block, const struct opcode *op, u32 pc)
 {
 	_jit_name(block->_jit, __func__);
-	rec_io(block, op, true, true);
+
+	if (!rec_unaligned_pair(block, op, false))
+		rec_io(block, op, true, true);
 }
 
 static void rec_LWR(const struct block *block, const struct opcode *op, u32 pc)
 {
 	_jit_name(block->_jit, __func__);
-	rec_io(block, op, true, true);
+
+	if (!rec_unaligned_pair(block, op, false))
+		rec_io(block, op, true, true);
 }
 
 static void rec_LW(const struct block *block, const struct opcode *op, u32 pc)
@@ -1164,6 +2007,70 @@ static void rec_LWC2(const struct block *block, const struct opcode *op, u32 pc)
 	rec_io(block, op, false, false);
 }
 
+static size_t rec_cop0_offset(u8 reg)
+{
+	return offsetof(struct lightrec_state, cop0_regs) + reg * 4;
+}
+
+static bool rec_is_delay_slot(const struct block *block,
+			      const struct opcode *op)
+{
+	const struct opcode *prev;
+
+	for (prev = block->opcode_list; prev && prev->next != op; )
+		prev = prev->next;
+
+	return prev && has_delay_slot(prev->c) &&
+		!(prev->flags & LIGHTREC_NO_DS);
+}
+
+static void rec_enter_exception(const struct block *block,
+				const struct opcode *op, u32 pc, u32 excode)
+{
+	struct regcache *reg_cache = block->state->reg_cache;
+	jit_state_t *_jit = block->_jit;
+	bool delay_slot = rec_is_delay_slot(block, op);
+	u32 cause = excode << 2;
+	u8 tmp, tmp2;
+
+	/* From a delay slot, EPC points to the branch and Cause.BD is set */
+	if (delay_slot)
+		cause |= 0x80000000;
+
+	tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
+	tmp2 = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+	/* Cause: clear BD and ExcCode, set the new values */
+	jit_ldxi_i(tmp, LIGHTREC_REG_STATE, rec_cop0_offset(13));
+	jit_andi(tmp, tmp, ~0x8000007c);
+	if (cause)
+		jit_ori(tmp, tmp, cause);
+	jit_stxi_i(rec_cop0_offset(13), LIGHTREC_REG_STATE, tmp);
+
+	jit_movi(tmp, delay_slot ? pc - 4 : pc);
+	jit_stxi_i(rec_cop0_offset(14), LIGHTREC_REG_STATE, tmp);
+
+	/* SR: push the KU/IE mode stack */
+	jit_ldxi_i(tmp, LIGHTREC_REG_STATE, rec_cop0_offset(12));
+	jit_lshi(tmp2, tmp, 2);
+	jit_andi(tmp2, tmp2, 0x3f);
+	jit_andi(tmp, tmp, ~0x3f);
+	jit_orr(tmp2, tmp2, tmp);
+	jit_stxi_i(rec_cop0_offset(12), LIGHTREC_REG_STATE, tmp2);
+
+	/* Vector: 0xbfc00180 if SR.BEV is set, 0x80000080 otherwise */
+	jit_rshi_u(tmp, tmp, 22);
+	jit_andi(tmp, tmp, 0x1);
+	jit_negr(tmp, tmp);
+	jit_andi(tmp, tmp, 0xbfc00180 - 0x80000080);
+	jit_addi(tmp, tmp, 0x80000080);
+
+	lightrec_free_reg(reg_cache, tmp2);
+	lightrec_lock_reg(reg_cache, _jit, tmp);
+
+	lightrec_emit_end_of_block(block, op, pc, tmp, 0, 31, 0, true);
+}
+
 static void rec_break_syscall(const struct block *block,
 			      const struct opcode *op, u32 pc, bool is_break)
 {
@@ -1174,6 +2081,11 @@ static void rec_break_syscall(const struct block *block,
 
 	jit_note(__FILE__, __LINE__);
 
+	if (block->state->builtin_exceptions) {
+		rec_enter_exception(block, op, pc, is_break ? 9 : 8);
+		return;
+	}
+
 	if (is_break)
 		offset = offsetof(struct lightrec_state, break_func);
 	else
@@ -1204,54 +2116,269 @@ static void rec_special_BREAK(const struct block *block,
 	rec_break_syscall(block, op, pc, true);
 }
 
+static const struct lightrec_cop_ops *
+get_cop_ops(const struct block *block, const struct opcode *op)
+{
+	if (op->i.op == OP_CP0)
+		return &block->state->ops.cop0_ops;
+	else
+		return &block->state->ops.cop2_ops;
+}
+
+static bool rec_gte_is_builtin(const struct block *block,
+			       const struct opcode *op)
+{
+	return ENABLE_GTE && op->i.op == OP_CP2 && block->state->builtin_gte;
+}
+
+static size_t rec_gte_offset(u8 reg, bool ctrl)
+{
+	if (ctrl)
+		return offsetof(struct lightrec_state, gte.ctrl) + reg * 4;
+	else
+		return offsetof(struct lightrec_state, gte.data) + reg * 4;
+}
+
+static void rec_gte_mfc(const struct block *block, const struct opcode *op,
+			bool is_cfc)
+{
+	struct regcache *reg_cache = block->state->reg_cache;
+	jit_state_t *_jit = block->_jit;
+	size_t offset = rec_gte_offset(op->r.rd, is_cfc);
+	u8 rt;
+
+	if (!op->r.rt)
+		return;
+
+	rt = lightrec_alloc_reg_out_ext(reg_cache, _jit, op->r.rt);
+
+	if (is_cfc) {
+		jit_ldxi_i(rt, LIGHTREC_REG_STATE, offset);
+	} else {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		/* Offset of the low 16 bits of the register */
+		size_t offset16 = offset + 2;
+#else
+		size_t offset16 = offset;
+#endif
+
+		switch (op->r.rd) {
+		case 1:
+		case 3:
+		case 5:
+		case 8:
+		case 9:
+		case 10:
+		case 11:
+			jit_ldxi_s(rt, LIGHTREC_REG_STATE, offset16);
+			break;
+		case 7:
+		case 16:
+		case 17:
+		case 18:
+		case 19:
+			jit_ldxi_us(rt, LIGHTREC_REG_STATE, offset16);
+			break;
+		default:
+			jit_ldxi_i(rt, LIGHTREC_REG_STATE, offset);
+			break;
+		}
+	}
+
+	lightrec_free_reg(reg_cache, rt);
+}
+
+static void rec_gte_mtc(const struct block *block, const struct opcode *op,
+			bool is_ctc)
+{
+	struct regcache *reg_cache = block->state->reg_cache;
+	jit_state_t *_jit = block->_jit;
+	size_t offset = rec_gte_offset(op->r.rd, is_ctc);
+	u8 rt, tmp;
+
+	rt = lightrec_alloc_reg_in(reg_cache, _jit, op->r.rt);
+
+	if (is_ctc && lightrec_gte_ctc_is_signed(op->r.rd)) {
+		tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
+		jit_extr_s(tmp, rt);
+		jit_stxi_i(offset, LIGHTREC_REG_STATE, tmp);
+		lightrec_free_reg(reg_cache, tmp);
+	} else {
+		jit_stxi_i(offset, LIGHTREC_REG_STATE, rt);
+	}
+
+	lightrec_free_reg(reg_cache, rt);
+}
+
+static void rec_cop0_mirror_mfc(const struct block *block,
+				const struct opcode *op)
+{
+	struct regcache *reg_cache = block->state->reg_cache;
+	jit_state_t *_jit = block->_jit;
+	u8 rt;
+
+	if (!op->r.rt)
+		return;
+
+	rt = lightrec_alloc_reg_out_ext(reg_cache, _jit, op->r.rt);
+	jit_ldxi_i(rt, LIGHTREC_REG_STATE, rec_cop0_offset(op->r.rd));
+	lightrec_free_reg(reg_cache, rt);
+}
+
+static void rec_cop0_mirror_mtc(const struct block *block,
+				const struct opcode *op, u32 pc)
+{
+	struct regcache *reg_cache = block->state->reg_cache;
+	struct native_register *regs_backup;
+	jit_state_t *_jit = block->_jit;
+	size_t offset = rec_cop0_offset(op->r.rd);
+	bool is_ctc = op->r.rs == OP_CP0_CTC0;
+	u8 rt, old, new, tmp;
+	jit_node_t *skip;
+	u32 mask;
+
+	rt = lightrec_alloc_reg_in(reg_cache, _jit, op->r.rt);
+
+	if (op->r.rd != 12 && op->r.rd != 13) {
+		/* No side effect: plain store */
+		jit_stxi_i(offset, LIGHTREC_REG_STATE, rt);
+		lightrec_free_reg(reg_cache, rt);
+		return;
+	}
+
+	old = lightrec_alloc_reg_temp(reg_cache, _jit);
+	tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+	jit_ldxi_i(old, LIGHTREC_REG_STATE, offset);
+
+	if (op->r.rd == 13) {
+		/* Only the software interrupt bits of Cause are writable */
+		new = lightrec_alloc_reg_temp(reg_cache, _jit);
+		jit_andi(tmp, rt, 0x300);
+		jit_andi(new, old, ~0x300);
+		jit_orr(new, new, tmp);
+		mask = 0x300;
+	} else {
+		new = rt;
+		mask = BIT(0) | 0xff00 | BIT(16);
+	}
+
+	jit_stxi_i(offset, LIGHTREC_REG_STATE, new);
+
+	/* Exit the block only if the host must be notified */
+	jit_xorr(tmp, old, new);
+	jit_andi(tmp, tmp, mask);
+	skip = jit_beqi(tmp, 0);
+
+	lightrec_free_regs(reg_cache);
+	regs_backup = lightrec_regcache_enter_branch(reg_cache);
+
+	rec_c_call_enter(block, true);
+
+	rt = lightrec_alloc_reg_in(reg_cache, _jit, op->r.rt);
+
+	jit_prepare();
+	jit_pushargr(LIGHTREC_REG_STATE);
+	jit_pushargi(op->r.rd);
+	jit_pushargr(rt);
+	jit_pushargi(is_ctc);
+	jit_finishi(lightrec_cop0_notify);
+
+	lightrec_free_reg(reg_cache, rt);
+
+	rec_c_call_leave(block, true);
+
+	lightrec_emit_end_of_block(block, op, pc, -1, pc + 4, 0, 0, true);
+
+	jit_patch(skip);
+	lightrec_regcache_leave_branch(reg_cache, regs_backup);
+}
+
 static void rec_mfc(const struct block *block, const struct opcode *op)
 {
-	u8 tmp, tmp2;
 	struct lightrec_state *state = block->state;
 	struct regcache *reg_cache = state->reg_cache;
+	const struct lightrec_cop_ops *ops = get_cop_ops(block, op);
 	jit_state_t *_jit = block->_jit;
+	bool is_cfc, builtin_gte = rec_gte_is_builtin(block, op);
+	u8 rt;
 
 	jit_note(__FILE__, __LINE__);
 
-	tmp = lightrec_alloc_reg(reg_cache, _jit, JIT_R0);
-	tmp2 = lightrec_alloc_reg_temp(reg_cache, _jit);
+	is_cfc = op->r.rs == (op->i.op == OP_CP0 ? OP_CP0_CFC0 :
+			      OP_CP2_BASIC_CFC2);
 
-	jit_ldxi(tmp2, LIGHTREC_REG_STATE,
-		 offsetof(struct lightrec_state, mfc_func));
+	if (op->i.op == OP_CP0 && state->mirror_cop0) {
+		rec_cop0_mirror_mfc(block, op);
+		return;
+	}
 
-	lightrec_clean_reg_if_loaded(reg_cache, _jit, op->i.rt, true);
+	/* The built-in GTE registers live in the state structure */
+	if (builtin_gte && (is_cfc || !lightrec_gte_mfc_is_special(op->r.rd))) {
+		rec_gte_mfc(block, op, is_cfc);
+		return;
+	}
 
-	jit_movi(tmp, op->opcode);
-	jit_callr(tmp2);
-	lightrec_free_reg(reg_cache, tmp);
-	lightrec_free_reg(reg_cache, tmp2);
+	rec_c_call_enter(block, !builtin_gte);
 
-	lightrec_regcache_mark_live(reg_cache, _jit);
+	jit_prepare();
+	jit_pushargr(LIGHTREC_REG_STATE);
+	jit_pushargi(op->r.rd);
+	jit_finishi(is_cfc ? ops->cfc : ops->mfc);
+
+	if (op->r.rt) {
+		rt = lightrec_alloc_reg_out_ext(reg_cache, _jit, op->r.rt);
+#if __WORDSIZE == 64
+		jit_retval_i(rt);
+#else
+		jit_retval(rt);
+#endif
+		lightrec_free_reg(reg_cache, rt);
+	}
+
+	rec_c_call_leave(block, !builtin_gte);
 }
 
 static void rec_mtc(const struct block *block, const struct opcode *op, u32 pc)
 {
 	struct lightrec_state *state = block->state;
 	struct regcache *reg_cache = state->reg_cache;
+	const struct lightrec_cop_ops *ops = get_cop_ops(block, op);
 	jit_state_t *_jit = block->_jit;
-	u8 tmp, tmp2;
+	bool is_ctc, builtin_gte = rec_gte_is_builtin(block, op);
+	u8 rt;
 
 	jit_note(__FILE__, __LINE__);
 
-	tmp = lightrec_alloc_reg(reg_cache, _jit, JIT_R0);
-	tmp2 = lightrec_alloc_reg_temp(reg_cache, _jit);
-	jit_ldxi(tmp2, LIGHTREC_REG_STATE,
-		 offsetof(struct lightrec_state, mtc_func));
+	is_ctc = op->r.rs == (op->i.op == OP_CP0 ? OP_CP0_CTC0 :
+			      OP_CP2_BASIC_CTC2);
 
-	lightrec_clean_reg_if_loaded(reg_cache, _jit, op->i.rs, false);
-	lightrec_clean_reg_if_loaded(reg_cache, _jit, op->i.rt, false);
+	if (op->i.op == OP_CP0 && state->mirror_cop0 &&
+	    (op->r.rd == 8 || op->r.rd == 12 ||
+	     op->r.rd == 13 || op->r.rd == 14)) {
+		rec_cop0_mirror_mtc(block, op, pc);
+		return;
+	}
 
-	jit_movi(tmp, op->opcode);
-	jit_callr(tmp2);
-	lightrec_free_reg(reg_cache, tmp);
-	lightrec_free_reg(reg_cache, tmp2);
+	if (builtin_gte && (is_ctc ? op->r.rd != 31 :
+			    !lightrec_gte_mtc_is_special(op->r.rd))) {
+		rec_gte_mtc(block, op, is_ctc);
+		return;
+	}
 
-	lightrec_regcache_mark_live(reg_cache, _jit);
+	rec_c_call_enter(block, !builtin_gte);
+
+	rt = lightrec_alloc_reg_in(reg_cache, _jit, op->r.rt);
+
+	jit_prepare();
+	jit_pushargr(LIGHTREC_REG_STATE);
+	jit_pushargi(op->r.rd);
+	jit_pushargr(rt);
+	jit_finishi(is_ctc ? ops->ctc : ops->mtc);
+
+	lightrec_free_reg(reg_cache, rt);
+
+	rec_c_call_leave(block, !builtin_gte);
 
 	if (op->i.op == OP_CP0 && (op->r.rd == 12 || op->r.rd == 13))
 		lightrec_emit_end_of_block(block, op, pc, -1, pc + 4, 0, 0, true);
@@ -1313,6 +2440,56 @@ static void rec_cp2_basic_CTC2(const struct block *block,
 	rec_mtc(block, op, pc);
 }
 
+static void rec_cop0_mirror_rfe(const struct block *block)
+{
+	struct regcache *reg_cache = block->state->reg_cache;
+	struct native_register *regs_backup;
+	jit_state_t *_jit = block->_jit;
+	jit_node_t *skip;
+	u8 old, new, tmp;
+
+	old = lightrec_alloc_reg_temp(reg_cache, _jit);
+	new = lightrec_alloc_reg_temp(reg_cache, _jit);
+	tmp = lightrec_alloc_reg_temp(reg_cache, _jit);
+
+	/* Pop the KU/IE mode stack */
+	jit_ldxi_i(old, LIGHTREC_REG_STATE, rec_cop0_offset(12));
+	jit_andi(tmp, old, 0x3c);
+	jit_rshi_u(tmp, tmp, 2);
+	jit_andi(new, old, ~0xf);
+	jit_orr(new, new, tmp);
+	jit_stxi_i(rec_cop0_offset(12), LIGHTREC_REG_STATE, new);
+
+	/* Notify the host only if IEc changed. RFE is generally in the delay
+	 * slot of the JR ending the handler, so there's no need to exit the
+	 * block here. */
+	jit_xorr(tmp, old, new);
+	jit_andi(tmp, tmp, BIT(0));
+	skip = jit_beqi(tmp, 0);
+
+	lightrec_free_reg(reg_cache, tmp);
+	lightrec_free_reg(reg_cache, old);
+	lightrec_free_reg(reg_cache, new);
+
+	regs_backup = lightrec_regcache_enter_branch(reg_cache);
+
+	rec_c_call_enter(block, true);
+
+	jit_ldxi_i(JIT_R1, LIGHTREC_REG_STATE, rec_cop0_offset(12));
+
+	jit_prepare();
+	jit_pushargr(LIGHTREC_REG_STATE);
+	jit_pushargi(12);
+	jit_pushargr(JIT_R1);
+	jit_pushargi(true);
+	jit_finishi(lightrec_cop0_notify);
+
+	rec_c_call_leave(block, true);
+
+	jit_patch(skip);
+	lightrec_regcache_leave_branch(reg_cache, regs_backup);
+}
+
 static void rec_cp0_RFE(const struct block *block,
 			const struct opcode *op, u32 pc)
 {
@@ -1323,6 +2500,11 @@ static void rec_cp0_RFE(const struct block *block,
 	jit_name(__func__);
 	jit_note(__FILE__, __LINE__);
 
+	if (state->mirror_cop0) {
+		rec_cop0_mirror_rfe(block);
+		return;
+	}
+
 	tmp = lightrec_alloc_reg_temp(state->reg_cache, _jit);
 	jit_ldxi(tmp, LIGHTREC_REG_STATE,
 		 offsetof(struct lightrec_state, rfe_func));
@@ -1334,25 +2516,35 @@ static void rec_cp0_RFE(const struct block *block,
 
 static void rec_CP(const struct block *block, const struct opcode *op, u32 pc)
 {
-	struct regcache *reg_cache = block->state->reg_cache;
+	struct lightrec_state *state = block->state;
 	jit_state_t *_jit = block->_jit;
-	u8 tmp, tmp2;
+	void (*func)(struct lightrec_state *, u32);
+	bool builtin_gte = false;
+
+	if ((op->opcode >> 25) & 1) {
+		/* Call the built-in GTE command directly, bypassing the
+		 * dispatch on the command number */
+		if (ENABLE_GTE && state->builtin_gte) {
+			builtin_gte = true;
+			func = lightrec_gte_get_func(op->opcode);
+		} else {
+			func = state->ops.cop2_ops.op;
+		}
+	} else {
+		func = state->ops.cop0_ops.op;
+	}
 
 	jit_name(__func__);
 	jit_note(__FILE__, __LINE__);
 
-	tmp = lightrec_alloc_reg(reg_cache, _jit, JIT_R0);
-	tmp2 = lightrec_alloc_reg_temp(reg_cache, _jit);
-
-	jit_ldxi(tmp2, LIGHTREC_REG_STATE,
-		 offsetof(struct lightrec_state, cp_func));
+	rec_c_call_enter(block, !builtin_gte);
 
-	jit_movi(tmp, op->opcode);
-	jit_callr(tmp2);
-	lightrec_free_reg(reg_cache, tmp);
-	lightrec_free_reg(reg_cache, tmp2);
+	jit_prepare();
+	jit_pushargr(LIGHTREC_REG_STATE);
+	jit_pushargi(op->opcode);
+	jit_finishi(func);
 
-	lightrec_regcache_mark_live(reg_cache, _jit);
+	rec_c_call_leave(block, !builtin_gte);
 }
 
 static void rec_meta_unload(const struct block *block,
@@ -1413,9 +2605,36 @@ static void rec_meta_MOV(const struct block *block,
 	lightrec_free_reg(state->reg_cache, rd);
 }
 
+static void rec_bulk_loop(const struct block *block,
+			  const struct lightrec_bulk_loop *loop)
+{
+	jit_state_t *_jit = block->_jit;
+
+	jit_note(__FILE__, __LINE__);
+	rec_c_call_enter(block, false);
+
+	/* Run all but the last iteration of the loop in C, then let the
+	 * recompiled loop body handle the rest */
+	jit_prepare();
+	jit_pushargr(LIGHTREC_REG_STATE);
+	jit_pushargi(loop->dst | loop->src << 5 | loop->data << 10 |
+		     loop->cnt << 15 | loop->end << 20 |
+		     (u32) loop->cnt_pre << 25);
+	jit_pushargi((u16) loop->dst_off | (u32)(u16) loop->src_off << 16);
+	jit_pushargi((u16) loop->cnt_step | (u32) loop->cycles << 16);
+	jit_pushargr(LIGHTREC_REG_CYCLE);
+	jit_finishi(lightrec_bulk_loop);
+	jit_retval_i(JIT_R0);
+
+	jit_subr(LIGHTREC_REG_CYCLE, LIGHTREC_REG_CYCLE, JIT_R0);
+
+	rec_c_call_leave(block, false);
+}
+
 static void rec_meta_sync(const struct block *block,
 			  const struct opcode *op, u32 pc)
 {
+	struct lightrec_bulk_loop loop;
 	struct lightrec_state *state = block->state;
 	struct lightrec_branch_target *target;
 	jit_state_t *_jit = block->_jit;
@@ -1429,6 +2648,10 @@ static void rec_meta_sync(const struct block *block,
 	lightrec_storeback_regs(state->reg_cache, _jit);
 	lightrec_regcache_reset(state->reg_cache);
 
+	if ((op->flags & LIGHTREC_BULK_LOOP) &&
+	    lightrec_get_bulk_loop(block, op, &loop))
+		rec_bulk_loop(block, &loop);
+
 	pr_debug("Adding branch target at offset 0x%x\n",
 		 op->offset << 2);
 	target = &state->targets[state->nb_targets++];
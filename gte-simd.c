@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2020 Paul Cercueil <paul@crapouillou.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "debug.h"
+#include "gte.h"
+#include "lightrec-private.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#	include <immintrin.h>
+#	define GTE_SIMD_X86 1
+#elif defined(__aarch64__)
+#	include <arm_neon.h>
+#	define GTE_SIMD_NEON 1
+#endif
+
+#define GTE_MAC_BIAS	(1LL << 43)
+
+/*
+ * All the kernels compute, for each row i:
+ *   sum[i] = tr[i] * 0x1000 + m[i][0] * v[0] + m[i][1] * v[1] + m[i][2] * v[2]
+ * and return false if any of the partial sums does not fit in 44 bits. The
+ * caller then falls back to the scalar code, which sets the overflow flags.
+ */
+
+static bool gte_mvmul_c(const s32 m[9], const s32 v[3],
+			const s32 tr[3], s64 sum[3])
+{
+	unsigned int i, j;
+	s64 tmp;
+
+	for (i = 0; i < 3; i++) {
+		tmp = (s64)tr[i] * 0x1000;
+
+		for (j = 0; j < 3; j++) {
+			tmp += (s64)m[i * 3 + j] * v[j];
+
+			if (tmp >= GTE_MAC_BIAS || tmp < -GTE_MAC_BIAS)
+				return false;
+		}
+
+		sum[i] = tmp;
+	}
+
+	return true;
+}
+
+#if GTE_SIMD_X86
+__attribute__((target("sse4.1")))
+static bool gte_mvmul_sse41(const s32 m[9], const s32 v[3],
+			    const s32 tr[3], s64 sum[3])
+{
+	const __m128i bias = _mm_set1_epi64x(GTE_MAC_BIAS);
+	__m128i acc01, acc2, col01, col2, vv, ovf = _mm_setzero_si128();
+	unsigned int i;
+
+	/* Rows 0-1 in acc01, row 2 in acc2, as 64-bit lanes */
+	acc01 = _mm_slli_epi64(_mm_set_epi64x(tr[1], tr[0]), 12);
+	acc2 = _mm_slli_epi64(_mm_set_epi64x(0, tr[2]), 12);
+
+	for (i = 0; i < 3; i++) {
+		/* _mm_mul_epi32 only reads the even 32-bit lanes */
+		vv = _mm_set1_epi32(v[i]);
+		col01 = _mm_set_epi32(0, m[3 + i], 0, m[i]);
+		col2 = _mm_set_epi32(0, 0, 0, m[6 + i]);
+
+		acc01 = _mm_add_epi64(acc01, _mm_mul_epi32(col01, vv));
+		acc2 = _mm_add_epi64(acc2, _mm_mul_epi32(col2, vv));
+
+		/* Out of range iff (sum + 2^43) doesn't fit in 44 bits */
+		ovf = _mm_or_si128(ovf, _mm_srli_epi64(
+					_mm_add_epi64(acc01, bias), 44));
+		ovf = _mm_or_si128(ovf, _mm_srli_epi64(
+					_mm_add_epi64(acc2, bias), 44));
+	}
+
+	if (!_mm_testz_si128(ovf, ovf))
+		return false;
+
+	_mm_storeu_si128((__m128i *)sum, acc01);
+	_mm_storel_epi64((__m128i *)&sum[2], acc2);
+
+	return true;
+}
+
+__attribute__((target("avx2")))
+static bool gte_mvmul_avx2(const s32 m[9], const s32 v[3],
+			   const s32 tr[3], s64 sum[3])
+{
+	const __m256i bias = _mm256_set1_epi64x(GTE_MAC_BIAS);
+	__m256i acc, col, vv, ovf = _mm256_setzero_si256();
+	s64 out[4];
+	unsigned int i;
+
+	/* One row per 64-bit lane, the fourth lane is unused */
+	acc = _mm256_slli_epi64(_mm256_set_epi64x(0, tr[2], tr[1], tr[0]), 12);
+
+	for (i = 0; i < 3; i++) {
+		vv = _mm256_set1_epi64x(v[i]);
+		col = _mm256_set_epi64x(0, m[6 + i], m[3 + i], m[i]);
+
+		acc = _mm256_add_epi64(acc, _mm256_mul_epi32(col, vv));
+		ovf = _mm256_or_si256(ovf, _mm256_srli_epi64(
+					_mm256_add_epi64(acc, bias), 44));
+	}
+
+	if (!_mm256_testz_si256(ovf, ovf))
+		return false;
+
+	_mm256_storeu_si256((__m256i *)out, acc);
+	memcpy(sum, out, sizeof(*sum) * 3);
+
+	return true;
+}
+#endif /* GTE_SIMD_X86 */
+
+#if GTE_SIMD_NEON
+static bool gte_mvmul_neon(const s32 m[9], const s32 v[3],
+			   const s32 tr[3], s64 sum[3])
+{
+	const int64x2_t bias = vdupq_n_s64(GTE_MAC_BIAS);
+	uint64x2_t ovf = vdupq_n_u64(0);
+	int32x2_t col01, col2;
+	int64x2_t acc01, acc2;
+	unsigned int i;
+
+	/* Rows 0-1 in acc01, row 2 in acc2, as 64-bit lanes */
+	acc01 = vshlq_n_s64(vmovl_s32(vld1_s32(tr)), 12);
+	acc2 = vshlq_n_s64(vmovl_s32(vset_lane_s32(tr[2],
+						   vdup_n_s32(0), 0)), 12);
+
+	for (i = 0; i < 3; i++) {
+		col01 = vset_lane_s32(m[3 + i], vdup_n_s32(m[i]), 1);
+		col2 = vset_lane_s32(m[6 + i], vdup_n_s32(0), 0);
+
+		acc01 = vmlal_n_s32(acc01, col01, v[i]);
+		acc2 = vmlal_n_s32(acc2, col2, v[i]);
+
+		/* Out of range iff (sum + 2^43) doesn't fit in 44 bits */
+		ovf = vorrq_u64(ovf, vshrq_n_u64(vreinterpretq_u64_s64(
+					vaddq_s64(acc01, bias)), 44));
+		ovf = vorrq_u64(ovf, vshrq_n_u64(vreinterpretq_u64_s64(
+					vaddq_s64(acc2, bias)), 44));
+	}
+
+	if (vgetq_lane_u64(ovf, 0) | vgetq_lane_u64(ovf, 1))
+		return false;
+
+	vst1q_s64(sum, acc01);
+	sum[2] = vgetq_lane_s64(acc2, 0);
+
+	return true;
+}
+#endif /* GTE_SIMD_NEON */
+
+static u32 gte_simd_rand(u32 *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed;
+}
+
+/* Cross-check a kernel against the scalar reference, with random values
+ * biased towards the extremes of the input ranges */
+static bool gte_simd_check(lightrec_gte_mvmul_t kernel)
+{
+	static const s32 extremes[] = { 0, 1, -1, 0x7fff, -0x8000, };
+	s32 m[9], v[3], tr[3];
+	s64 sum[3], ref[3];
+	u32 seed = 1, rnd;
+	unsigned int i, j;
+	bool ret, ret_ref;
+
+	for (i = 0; i < 4096; i++) {
+		for (j = 0; j < 9; j++) {
+			rnd = gte_simd_rand(&seed);
+			m[j] = (rnd & 1) ? extremes[(rnd >> 1) % 5] :
+				(s16)(rnd >> 8);
+		}
+
+		for (j = 0; j < 3; j++) {
+			rnd = gte_simd_rand(&seed);
+			v[j] = (rnd & 1) ? extremes[(rnd >> 1) % 5] :
+				(s16)(rnd >> 8);
+
+			/* Translations close to the limits trigger overflows */
+			rnd = gte_simd_rand(&seed);
+			if (rnd & 1)
+				tr[j] = (s32)(gte_simd_rand(&seed) ^ rnd);
+			else if (rnd & 2)
+				tr[j] = (s32)(0x7fffffff - (rnd >> 20));
+			else
+				tr[j] = (s32)(0x80000000 + (rnd >> 20));
+		}
+
+		ret = kernel(m, v, tr, sum);
+		ret_ref = gte_mvmul_c(m, v, tr, ref);
+
+		if (ret != ret_ref || (ret && memcmp(sum, ref, sizeof(ref))))
+			return false;
+	}
+
+	return true;
+}
+
+lightrec_gte_mvmul_t lightrec_gte_get_mvmul(void)
+{
+	lightrec_gte_mvmul_t kernel = NULL;
+	const char *name = NULL;
+
+#if GTE_SIMD_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		kernel = gte_mvmul_avx2;
+		name = "AVX2";
+	} else if (__builtin_cpu_supports("sse4.1")) {
+		kernel = gte_mvmul_sse41;
+		name = "SSE4.1";
+	}
+#elif GTE_SIMD_NEON
+	kernel = gte_mvmul_neon;
+	name = "NEON";
+#endif
+
+	if (!kernel)
+		return NULL;
+
+	if (!gte_simd_check(kernel)) {
+		pr_warn("GTE %s kernel mismatch, using scalar code\n", name);
+		return NULL;
+	}
+
+	pr_debug("Using %s GTE kernels\n", name);
+
+	return kernel;
+}
@@ -0,0 +1,960 @@
+/*
+ * Copyright (C) 2020 Paul Cercueil <paul@crapouillou.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include "debug.h"
+#include "gte.h"
+#include "lightrec-private.h"
+
+#include <stdbool.h>
+
+/* Data registers */
+#define GTE_VXY0	0
+#define GTE_RGBC	6
+#define GTE_OTZ		7
+#define GTE_IR0		8
+#define GTE_SXY0	12
+#define GTE_SZ0		16
+#define GTE_RGB0	20
+#define GTE_MAC0	24
+#define GTE_IRGB	28
+#define GTE_LZCS	30
+#define GTE_LZCR	31
+
+/* Control registers */
+#define GTE_RT		0
+#define GTE_TR		5
+#define GTE_LLM		8
+#define GTE_BK		13
+#define GTE_LCM		16
+#define GTE_FC		21
+#define GTE_OFX		24
+#define GTE_OFY		25
+#define GTE_H		26
+#define GTE_DQA		27
+#define GTE_DQB		28
+#define GTE_ZSF3	29
+#define GTE_ZSF4	30
+#define GTE_FLAG	31
+
+#define GTE_FLAG_ERROR	0x7f87e000
+
+#define GTE_SHIFT(op)	(((op) & BIT(19)) ? 12 : 0)
+#define GTE_LM(op)	(!!((op) & BIT(10)))
+#define GTE_MX(op)	(((op) >> 17) & 0x3)
+#define GTE_V(op)	(((op) >> 15) & 0x3)
+#define GTE_CV(op)	(((op) >> 13) & 0x3)
+
+/* Matrix and translation vector selected by the 'mx' and 'cv' fields of
+ * MVMVA. The fourth matrix is handled separately. */
+static const u8 gte_matrix_reg[] = { GTE_RT, GTE_LLM, GTE_LCM, };
+static const u8 gte_vector_reg[] = { GTE_TR, GTE_BK, GTE_FC, };
+
+/* Reciprocal table used by the UNR division */
+static u8 unr_table[0x101];
+
+/* Optional SIMD implementation of the matrix multiplications */
+static lightrec_gte_mvmul_t gte_mvmul;
+
+static inline s32 gte_ir(const struct lightrec_gte *gte, unsigned int i)
+{
+	return (s16)gte->data[GTE_IR0 + i];
+}
+
+static inline s32 gte_mx(const struct lightrec_gte *gte, unsigned int reg,
+			 unsigned int row, unsigned int col)
+{
+	unsigned int idx = row * 3 + col;
+
+	return (s16)(gte->ctrl[reg + idx / 2] >> (16 * (idx & 1)));
+}
+
+static void gte_get_vector(const struct lightrec_gte *gte,
+			   unsigned int v, s32 vec[3])
+{
+	if (v == 3) {
+		vec[0] = gte_ir(gte, 1);
+		vec[1] = gte_ir(gte, 2);
+		vec[2] = gte_ir(gte, 3);
+	} else {
+		vec[0] = (s16)gte->data[GTE_VXY0 + v * 2];
+		vec[1] = (s16)(gte->data[GTE_VXY0 + v * 2] >> 16);
+		vec[2] = (s16)gte->data[GTE_VXY0 + v * 2 + 1];
+	}
+}
+
+/* Checks a MAC1-3 value for 44-bit overflow, and sign-extends it */
+static s64 gte_A(struct lightrec_gte *gte, unsigned int i, s64 value)
+{
+	if (value >= (1LL << 43))
+		gte->ctrl[GTE_FLAG] |= BIT(30 - i);
+	else if (value < -(1LL << 43))
+		gte->ctrl[GTE_FLAG] |= BIT(27 - i);
+
+	return (s64)((u64)value << 20) >> 20;
+}
+
+static s64 gte_F(struct lightrec_gte *gte, s64 value)
+{
+	if (value > 0x7fffffffLL)
+		gte->ctrl[GTE_FLAG] |= BIT(16);
+	else if (value < -0x80000000LL)
+		gte->ctrl[GTE_FLAG] |= BIT(15);
+
+	return value;
+}
+
+static s32 gte_clamp(struct lightrec_gte *gte, s32 value,
+		     s32 min, s32 max, u32 flag)
+{
+	if (value < min) {
+		gte->ctrl[GTE_FLAG] |= flag;
+		return min;
+	}
+
+	if (value > max) {
+		gte->ctrl[GTE_FLAG] |= flag;
+		return max;
+	}
+
+	return value;
+}
+
+static s32 gte_lm_B(struct lightrec_gte *gte, unsigned int i,
+		    s32 value, bool lm)
+{
+	return gte_clamp(gte, value, lm ? 0 : -0x8000, 0x7fff, BIT(24 - i));
+}
+
+static s32 gte_lm_C(struct lightrec_gte *gte, unsigned int i, s32 value)
+{
+	return gte_clamp(gte, value, 0, 0xff, BIT(21 - i));
+}
+
+static s32 gte_lm_D(struct lightrec_gte *gte, s32 value)
+{
+	return gte_clamp(gte, value, 0, 0xffff, BIT(18));
+}
+
+static s32 gte_lm_G(struct lightrec_gte *gte, unsigned int i, s32 value)
+{
+	return gte_clamp(gte, value, -0x400, 0x3ff, BIT(14 - i));
+}
+
+static s32 gte_lm_H(struct lightrec_gte *gte, s32 value)
+{
+	return gte_clamp(gte, value, 0, 0x1000, BIT(12));
+}
+
+static inline void gte_set_mac(struct lightrec_gte *gte,
+			       unsigned int i, s32 value)
+{
+	gte->data[GTE_MAC0 + i] = (u32)value;
+}
+
+static inline s32 gte_mac(const struct lightrec_gte *gte, unsigned int i)
+{
+	return (s32)gte->data[GTE_MAC0 + i];
+}
+
+static inline void gte_set_ir(struct lightrec_gte *gte,
+			      unsigned int i, s32 value)
+{
+	gte->data[GTE_IR0 + i] = (u32)value;
+}
+
+static void gte_mac_to_ir(struct lightrec_gte *gte, bool lm)
+{
+	unsigned int i;
+
+	for (i = 1; i <= 3; i++)
+		gte_set_ir(gte, i, gte_lm_B(gte, i - 1, gte_mac(gte, i), lm));
+}
+
+static void gte_mac_to_rgb_fifo(struct lightrec_gte *gte)
+{
+	u32 r, g, b;
+
+	r = gte_lm_C(gte, 0, gte_mac(gte, 1) >> 4);
+	g = gte_lm_C(gte, 1, gte_mac(gte, 2) >> 4);
+	b = gte_lm_C(gte, 2, gte_mac(gte, 3) >> 4);
+
+	gte->data[GTE_RGB0] = gte->data[GTE_RGB0 + 1];
+	gte->data[GTE_RGB0 + 1] = gte->data[GTE_RGB0 + 2];
+	gte->data[GTE_RGB0 + 2] = r | (g << 8) | (b << 16) |
+		(gte->data[GTE_RGBC] & 0xff000000);
+}
+
+static u32 gte_divide(struct lightrec_gte *gte, u32 h, u32 sz3)
+{
+	u32 n, d, u, z;
+
+	if (h >= sz3 * 2) {
+		gte->ctrl[GTE_FLAG] |= BIT(17);
+		return 0x1ffff;
+	}
+
+	z = __builtin_clz(sz3) - 16;
+	n = h << z;
+	d = sz3 << z;
+	u = unr_table[(d - 0x7fc0) >> 7] + 0x101;
+	d = (0x2000080 - d * u) >> 8;
+	d = (0x0000080 + d * u) >> 8;
+
+	n = (u32)(((u64)n * d + 0x8000) >> 16);
+
+	return n < 0x1ffff ? n : 0x1ffff;
+}
+
+static void gte_get_matrix(const struct lightrec_gte *gte,
+			   unsigned int mx, s32 m[9])
+{
+	unsigned int i;
+	s32 r;
+
+	if (mx == 3) {
+		/* Reserved matrix: gives garbage results on hardware */
+		r = (gte->data[GTE_RGBC] & 0xff) << 4;
+		m[0] = -r;
+		m[1] = r;
+		m[2] = gte_ir(gte, 0);
+		m[3] = m[4] = m[5] = (s16)gte->ctrl[GTE_RT + 1];
+		m[6] = m[7] = m[8] = (s16)gte->ctrl[GTE_RT + 2];
+	} else {
+		for (i = 0; i < 9; i++)
+			m[i] = gte_mx(gte, gte_matrix_reg[mx], i / 3, i % 3);
+	}
+}
+
+static void gte_get_translation(const struct lightrec_gte *gte,
+				unsigned int cv, s32 tr[3])
+{
+	unsigned int i;
+
+	for (i = 0; i < 3; i++)
+		tr[i] = cv == 3 ? 0 : (s32)gte->ctrl[gte_vector_reg[cv] + i];
+}
+
+/* Computes tr * 0x1000 + m * vec, row by row, updating the overflow flags */
+static void gte_mul_rows(struct lightrec_gte *gte, const s32 m[9],
+			 const s32 vec[3], const s32 tr[3],
+			 unsigned int shift, bool fc_bug, s64 sum[3])
+{
+	unsigned int i;
+	s64 tmp;
+
+	/* The SIMD kernel bails out if any flag would be raised */
+	if (!fc_bug && gte_mvmul && gte_mvmul(m, vec, tr, sum))
+		return;
+
+	for (i = 0; i < 3; i++) {
+		tmp = (s64)tr[i] * 0x1000;
+		tmp = gte_A(gte, i, tmp + m[i * 3] * vec[0]);
+
+		/* Hardware bug: with the far color vector, the first column
+		 * only affects the flags */
+		if (fc_bug) {
+			gte_lm_B(gte, i, (s32)(tmp >> shift), false);
+			tmp = 0;
+		}
+
+		tmp = gte_A(gte, i, tmp + m[i * 3 + 1] * vec[1]);
+		tmp = gte_A(gte, i, tmp + m[i * 3 + 2] * vec[2]);
+
+		sum[i] = tmp;
+	}
+}
+
+static void gte_mul_matrix_vec(struct lightrec_gte *gte, const s32 m[9],
+			       const s32 vec[3], const s32 tr[3],
+			       unsigned int shift, bool lm, bool fc_bug)
+{
+	unsigned int i;
+	s64 sum[3];
+
+	gte_mul_rows(gte, m, vec, tr, shift, fc_bug, sum);
+
+	for (i = 0; i < 3; i++)
+		gte_set_mac(gte, i + 1, (s32)(sum[i] >> shift));
+
+	gte_mac_to_ir(gte, lm);
+}
+
+static void gte_mul_matrix(struct lightrec_gte *gte, unsigned int mx,
+			   const s32 vec[3], unsigned int cv,
+			   unsigned int shift, bool lm)
+{
+	s32 m[9], tr[3];
+
+	gte_get_matrix(gte, mx, m);
+	gte_get_translation(gte, cv, tr);
+	gte_mul_matrix_vec(gte, m, vec, tr, shift, lm, cv == 2);
+}
+
+static void gte_rtp(struct lightrec_gte *gte, const s32 rt[9],
+		    const s32 tr[3], unsigned int v,
+		    unsigned int shift, bool lm, bool last)
+{
+	s32 vec[3], sz3, sx, sy, ir3;
+	unsigned int i;
+	s64 sum[3], tmp, mac0;
+	u32 h_div_sz;
+
+	gte_get_vector(gte, v, vec);
+	gte_mul_rows(gte, rt, vec, tr, shift, false, sum);
+
+	for (i = 0; i < 3; i++)
+		gte_set_mac(gte, i + 1, (s32)(sum[i] >> shift));
+
+	tmp = sum[2];
+
+	gte_set_ir(gte, 1, gte_lm_B(gte, 0, gte_mac(gte, 1), lm));
+	gte_set_ir(gte, 2, gte_lm_B(gte, 1, gte_mac(gte, 2), lm));
+
+	/* The saturation flag of IR3 is always computed from the value
+	 * shifted by 12, independently of the 'sf' bit */
+	gte_lm_B(gte, 2, (s32)(tmp >> 12), false);
+	ir3 = gte_mac(gte, 3);
+	if (ir3 < (lm ? 0 : -0x8000))
+		ir3 = lm ? 0 : -0x8000;
+	else if (ir3 > 0x7fff)
+		ir3 = 0x7fff;
+	gte_set_ir(gte, 3, ir3);
+
+	sz3 = gte_lm_D(gte, (s32)(tmp >> 12));
+
+	for (i = 0; i < 3; i++)
+		gte->data[GTE_SZ0 + i] = gte->data[GTE_SZ0 + i + 1];
+	gte->data[GTE_SZ0 + 3] = sz3;
+
+	h_div_sz = gte_divide(gte, (u16)gte->ctrl[GTE_H], sz3);
+
+	mac0 = gte_F(gte, (s64)(s32)gte->ctrl[GTE_OFX] +
+		     (s64)gte_ir(gte, 1) * h_div_sz);
+	sx = gte_lm_G(gte, 0, (s32)(mac0 >> 16));
+
+	mac0 = gte_F(gte, (s64)(s32)gte->ctrl[GTE_OFY] +
+		     (s64)gte_ir(gte, 2) * h_div_sz);
+	sy = gte_lm_G(gte, 1, (s32)(mac0 >> 16));
+	gte_set_mac(gte, 0, (s32)(mac0 >> 16));
+
+	gte->data[GTE_SXY0] = gte->data[GTE_SXY0 + 1];
+	gte->data[GTE_SXY0 + 1] = gte->data[GTE_SXY0 + 2];
+	gte->data[GTE_SXY0 + 2] = (u16)sx | ((u32)(u16)sy << 16);
+
+	if (last) {
+		mac0 = gte_F(gte, (s64)(s32)gte->ctrl[GTE_DQB] +
+			     (s64)(s16)gte->ctrl[GTE_DQA] * h_div_sz);
+		gte_set_mac(gte, 0, (s32)mac0);
+		gte_set_ir(gte, 0, gte_lm_H(gte, (s32)(mac0 >> 12)));
+	}
+}
+
+static void gte_depth_cue(struct lightrec_gte *gte, bool mult_ir,
+			  bool rgb_from_fifo, unsigned int shift, bool lm)
+{
+	u32 rgb = gte->data[rgb_from_fifo ? GTE_RGB0 : GTE_RGBC];
+	s32 ir0 = gte_ir(gte, 0), col, ir;
+	unsigned int i;
+	s64 fc, prod;
+
+	for (i = 0; i < 3; i++) {
+		col = ((rgb >> (i * 8)) & 0xff) << 4;
+		fc = (s64)(s32)gte->ctrl[GTE_FC + i] * 4096;
+
+		if (mult_ir)
+			prod = col * gte_ir(gte, i + 1);
+		else
+			prod = (s64)col * 4096;
+
+		gte_set_mac(gte, i + 1,
+			    (s32)(gte_A(gte, i, fc - prod) >> shift));
+		ir = gte_lm_B(gte, i, gte_mac(gte, i + 1), false);
+		gte_set_mac(gte, i + 1,
+			    (s32)(gte_A(gte, i, prod + ir0 * ir) >> shift));
+	}
+
+	gte_mac_to_ir(gte, lm);
+	gte_mac_to_rgb_fifo(gte);
+}
+
+/* Matrices used by the lighting commands */
+struct gte_light {
+	s32 llm[9];
+	s32 lcm[9];
+	s32 bk[3];
+};
+
+static const s32 gte_null_vector[3];
+
+static void gte_get_light(const struct lightrec_gte *gte,
+			  struct gte_light *light)
+{
+	gte_get_matrix(gte, 1, light->llm);
+	gte_get_matrix(gte, 2, light->lcm);
+	gte_get_translation(gte, 1, light->bk);
+}
+
+static void gte_color_ir(struct lightrec_gte *gte,
+			 const struct gte_light *light,
+			 unsigned int shift, bool lm)
+{
+	s32 vec[3];
+
+	gte_get_vector(gte, 3, vec);
+	gte_mul_matrix_vec(gte, light->lcm, vec, light->bk, shift, lm, false);
+}
+
+static void gte_normal_color(struct lightrec_gte *gte,
+			     const struct gte_light *light, unsigned int v,
+			     unsigned int shift, bool lm)
+{
+	s32 vec[3];
+
+	gte_get_vector(gte, v, vec);
+	gte_mul_matrix_vec(gte, light->llm, vec, gte_null_vector,
+			   shift, lm, false);
+	gte_color_ir(gte, light, shift, lm);
+}
+
+static void gte_color_color(struct lightrec_gte *gte,
+			    unsigned int shift, bool lm)
+{
+	u32 rgb = gte->data[GTE_RGBC];
+	unsigned int i;
+	s32 col;
+
+	for (i = 0; i < 3; i++) {
+		col = ((rgb >> (i * 8)) & 0xff) << 4;
+		gte_set_mac(gte, i + 1, (col * gte_ir(gte, i + 1)) >> shift);
+	}
+
+	gte_mac_to_ir(gte, lm);
+	gte_mac_to_rgb_fifo(gte);
+}
+
+static inline void gte_begin(struct lightrec_gte *gte)
+{
+	gte->ctrl[GTE_FLAG] = 0;
+}
+
+static inline void gte_end(struct lightrec_gte *gte)
+{
+	if (gte->ctrl[GTE_FLAG] & GTE_FLAG_ERROR)
+		gte->ctrl[GTE_FLAG] |= BIT(31);
+}
+
+static void gte_RTPS(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+
+	s32 rt[9], tr[3];
+
+	gte_get_matrix(gte, 0, rt);
+	gte_get_translation(gte, 0, tr);
+
+	gte_begin(gte);
+	gte_rtp(gte, rt, tr, 0, GTE_SHIFT(op), GTE_LM(op), true);
+	gte_end(gte);
+}
+
+static void gte_RTPT(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+
+	s32 rt[9], tr[3];
+
+	gte_get_matrix(gte, 0, rt);
+	gte_get_translation(gte, 0, tr);
+
+	gte_begin(gte);
+	gte_rtp(gte, rt, tr, 0, GTE_SHIFT(op), GTE_LM(op), false);
+	gte_rtp(gte, rt, tr, 1, GTE_SHIFT(op), GTE_LM(op), false);
+	gte_rtp(gte, rt, tr, 2, GTE_SHIFT(op), GTE_LM(op), true);
+	gte_end(gte);
+}
+
+static void gte_NCLIP(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+	s32 sx0, sy0, sx1, sy1, sx2, sy2;
+	s64 mac0;
+
+	sx0 = (s16)gte->data[GTE_SXY0];
+	sy0 = (s16)(gte->data[GTE_SXY0] >> 16);
+	sx1 = (s16)gte->data[GTE_SXY0 + 1];
+	sy1 = (s16)(gte->data[GTE_SXY0 + 1] >> 16);
+	sx2 = (s16)gte->data[GTE_SXY0 + 2];
+	sy2 = (s16)(gte->data[GTE_SXY0 + 2] >> 16);
+
+	gte_begin(gte);
+
+	mac0 = (s64)(sx0 * sy1) + sx1 * sy2 + sx2 * sy0
+		- sx0 * sy2 - sx1 * sy0 - sx2 * sy1;
+	gte_set_mac(gte, 0, (s32)gte_F(gte, mac0));
+
+	gte_end(gte);
+}
+
+static void gte_OP(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+	unsigned int shift = GTE_SHIFT(op);
+	s32 d1, d2, d3, ir1, ir2, ir3;
+
+	d1 = gte_mx(gte, GTE_RT, 0, 0);
+	d2 = gte_mx(gte, GTE_RT, 1, 1);
+	d3 = gte_mx(gte, GTE_RT, 2, 2);
+	ir1 = gte_ir(gte, 1);
+	ir2 = gte_ir(gte, 2);
+	ir3 = gte_ir(gte, 3);
+
+	gte_begin(gte);
+
+	gte_set_mac(gte, 1, (s32)(gte_A(gte, 0, (s64)(d2 * ir3) - d3 * ir2) >> shift));
+	gte_set_mac(gte, 2, (s32)(gte_A(gte, 1, (s64)(d3 * ir1) - d1 * ir3) >> shift));
+	gte_set_mac(gte, 3, (s32)(gte_A(gte, 2, (s64)(d1 * ir2) - d2 * ir1) >> shift));
+	gte_mac_to_ir(gte, GTE_LM(op));
+
+	gte_end(gte);
+}
+
+static void gte_DPCS(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+
+	gte_begin(gte);
+	gte_depth_cue(gte, false, false, GTE_SHIFT(op), GTE_LM(op));
+	gte_end(gte);
+}
+
+static void gte_INTPL(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+	unsigned int i, shift = GTE_SHIFT(op);
+	s32 ir0 = gte_ir(gte, 0), ir;
+	s64 fc, prod;
+
+	gte_begin(gte);
+
+	for (i = 0; i < 3; i++) {
+		fc = (s64)(s32)gte->ctrl[GTE_FC + i] * 4096;
+		prod = (s64)gte_ir(gte, i + 1) * 4096;
+
+		gte_set_mac(gte, i + 1,
+			    (s32)(gte_A(gte, i, fc - prod) >> shift));
+		ir = gte_lm_B(gte, i, gte_mac(gte, i + 1), false);
+		gte_set_mac(gte, i + 1,
+			    (s32)(gte_A(gte, i, prod + ir0 * ir) >> shift));
+	}
+
+	gte_mac_to_ir(gte, GTE_LM(op));
+	gte_mac_to_rgb_fifo(gte);
+
+	gte_end(gte);
+}
+
+static void gte_MVMVA(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+	s32 vec[3];
+
+	gte_get_vector(gte, GTE_V(op), vec);
+
+	gte_begin(gte);
+	gte_mul_matrix(gte, GTE_MX(op), vec, GTE_CV(op),
+		       GTE_SHIFT(op), GTE_LM(op));
+	gte_end(gte);
+}
+
+static void gte_NCDS(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+	struct gte_light light;
+
+	gte_get_light(gte, &light);
+
+	gte_begin(gte);
+	gte_normal_color(gte, &light, 0, GTE_SHIFT(op), GTE_LM(op));
+	gte_depth_cue(gte, true, false, GTE_SHIFT(op), GTE_LM(op));
+	gte_end(gte);
+}
+
+static void gte_NCDT(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+	struct gte_light light;
+	unsigned int v;
+
+	gte_get_light(gte, &light);
+
+	gte_begin(gte);
+
+	for (v = 0; v < 3; v++) {
+		gte_normal_color(gte, &light, v, GTE_SHIFT(op), GTE_LM(op));
+		gte_depth_cue(gte, true, false, GTE_SHIFT(op), GTE_LM(op));
+	}
+
+	gte_end(gte);
+}
+
+static void gte_CDP(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+	struct gte_light light;
+
+	gte_get_light(gte, &light);
+
+	gte_begin(gte);
+	gte_color_ir(gte, &light, GTE_SHIFT(op), GTE_LM(op));
+	gte_depth_cue(gte, true, false, GTE_SHIFT(op), GTE_LM(op));
+	gte_end(gte);
+}
+
+static void gte_NCCS(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+	struct gte_light light;
+
+	gte_get_light(gte, &light);
+
+	gte_begin(gte);
+	gte_normal_color(gte, &light, 0, GTE_SHIFT(op), GTE_LM(op));
+	gte_color_color(gte, GTE_SHIFT(op), GTE_LM(op));
+	gte_end(gte);
+}
+
+static void gte_NCCT(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+	struct gte_light light;
+	unsigned int v;
+
+	gte_get_light(gte, &light);
+
+	gte_begin(gte);
+
+	for (v = 0; v < 3; v++) {
+		gte_normal_color(gte, &light, v, GTE_SHIFT(op), GTE_LM(op));
+		gte_color_color(gte, GTE_SHIFT(op), GTE_LM(op));
+	}
+
+	gte_end(gte);
+}
+
+static void gte_CC(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+	struct gte_light light;
+
+	gte_get_light(gte, &light);
+
+	gte_begin(gte);
+	gte_color_ir(gte, &light, GTE_SHIFT(op), GTE_LM(op));
+	gte_color_color(gte, GTE_SHIFT(op), GTE_LM(op));
+	gte_end(gte);
+}
+
+static void gte_NCS(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+	struct gte_light light;
+
+	gte_get_light(gte, &light);
+
+	gte_begin(gte);
+	gte_normal_color(gte, &light, 0, GTE_SHIFT(op), GTE_LM(op));
+	gte_mac_to_rgb_fifo(gte);
+	gte_end(gte);
+}
+
+static void gte_NCT(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+	struct gte_light light;
+	unsigned int v;
+
+	gte_get_light(gte, &light);
+
+	gte_begin(gte);
+
+	for (v = 0; v < 3; v++) {
+		gte_normal_color(gte, &light, v, GTE_SHIFT(op), GTE_LM(op));
+		gte_mac_to_rgb_fifo(gte);
+	}
+
+	gte_end(gte);
+}
+
+static void gte_SQR(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+	unsigned int i, shift = GTE_SHIFT(op);
+	s32 ir;
+
+	gte_begin(gte);
+
+	for (i = 1; i <= 3; i++) {
+		ir = gte_ir(gte, i);
+		gte_set_mac(gte, i, (ir * ir) >> shift);
+	}
+
+	gte_mac_to_ir(gte, GTE_LM(op));
+
+	gte_end(gte);
+}
+
+static void gte_DCPL(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+
+	gte_begin(gte);
+	gte_depth_cue(gte, true, false, GTE_SHIFT(op), GTE_LM(op));
+	gte_end(gte);
+}
+
+static void gte_DPCT(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+	unsigned int i;
+
+	gte_begin(gte);
+
+	for (i = 0; i < 3; i++)
+		gte_depth_cue(gte, false, true, GTE_SHIFT(op), GTE_LM(op));
+
+	gte_end(gte);
+}
+
+static void gte_avsz(struct lightrec_gte *gte, s32 zsf, u32 sum)
+{
+	s64 mac0;
+
+	gte_begin(gte);
+
+	mac0 = gte_F(gte, (s64)zsf * sum);
+	gte_set_mac(gte, 0, (s32)mac0);
+	gte->data[GTE_OTZ] = gte_lm_D(gte, (s32)(mac0 >> 12));
+
+	gte_end(gte);
+}
+
+static void gte_AVSZ3(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+
+	gte_avsz(gte, (s16)gte->ctrl[GTE_ZSF3],
+		 (u16)gte->data[GTE_SZ0 + 1] + (u16)gte->data[GTE_SZ0 + 2] +
+		 (u16)gte->data[GTE_SZ0 + 3]);
+}
+
+static void gte_AVSZ4(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+
+	gte_avsz(gte, (s16)gte->ctrl[GTE_ZSF4],
+		 (u16)gte->data[GTE_SZ0] + (u16)gte->data[GTE_SZ0 + 1] +
+		 (u16)gte->data[GTE_SZ0 + 2] + (u16)gte->data[GTE_SZ0 + 3]);
+}
+
+static void gte_GPF(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+	unsigned int i, shift = GTE_SHIFT(op);
+	s32 ir0 = gte_ir(gte, 0);
+
+	gte_begin(gte);
+
+	for (i = 1; i <= 3; i++)
+		gte_set_mac(gte, i, (ir0 * gte_ir(gte, i)) >> shift);
+
+	gte_mac_to_ir(gte, GTE_LM(op));
+	gte_mac_to_rgb_fifo(gte);
+
+	gte_end(gte);
+}
+
+static void gte_GPL(struct lightrec_state *state, u32 op)
+{
+	struct lightrec_gte *gte = &state->gte;
+	unsigned int i, shift = GTE_SHIFT(op);
+	s32 ir0 = gte_ir(gte, 0);
+	s64 mac;
+
+	gte_begin(gte);
+
+	for (i = 1; i <= 3; i++) {
+		mac = (s64)gte_mac(gte, i) * (1 << shift);
+		mac = gte_A(gte, i - 1, mac + ir0 * gte_ir(gte, i));
+		gte_set_mac(gte, i, (s32)(mac >> shift));
+	}
+
+	gte_mac_to_ir(gte, GTE_LM(op));
+	gte_mac_to_rgb_fifo(gte);
+
+	gte_end(gte);
+}
+
+static void gte_unknown(struct lightrec_state *state, u32 op)
+{
+	pr_warn("Unknown GTE command 0x%02x\n", op & 0x3f);
+}
+
+static const lightrec_gte_func_t gte_cmds[64] = {
+	[0x01] = gte_RTPS,
+	[0x06] = gte_NCLIP,
+	[0x0c] = gte_OP,
+	[0x10] = gte_DPCS,
+	[0x11] = gte_INTPL,
+	[0x12] = gte_MVMVA,
+	[0x13] = gte_NCDS,
+	[0x14] = gte_CDP,
+	[0x16] = gte_NCDT,
+	[0x1b] = gte_NCCS,
+	[0x1c] = gte_CC,
+	[0x1e] = gte_NCS,
+	[0x20] = gte_NCT,
+	[0x28] = gte_SQR,
+	[0x29] = gte_DCPL,
+	[0x2a] = gte_DPCT,
+	[0x2d] = gte_AVSZ3,
+	[0x2e] = gte_AVSZ4,
+	[0x30] = gte_RTPT,
+	[0x3d] = gte_GPF,
+	[0x3e] = gte_GPL,
+	[0x3f] = gte_NCCT,
+};
+
+lightrec_gte_func_t lightrec_gte_get_func(u32 op)
+{
+	lightrec_gte_func_t func = gte_cmds[op & 0x3f];
+
+	return func ? func : gte_unknown;
+}
+
+static void gte_op(struct lightrec_state *state, u32 op)
+{
+	lightrec_gte_get_func(op)(state, op);
+}
+
+static u32 gte_mfc(struct lightrec_state *state, u8 reg)
+{
+	const struct lightrec_gte *gte = &state->gte;
+	s32 r, g, b;
+
+	switch (reg) {
+	case 1:
+	case 3:
+	case 5:
+	case 8:
+	case 9:
+	case 10:
+	case 11:
+		return (s32)(s16)gte->data[reg];
+	case 7:
+	case 16:
+	case 17:
+	case 18:
+	case 19:
+		return (u16)gte->data[reg];
+	case 15:
+		return gte->data[GTE_SXY0 + 2];
+	case 28:
+	case 29:
+		r = gte_ir(gte, 1) >> 7;
+		g = gte_ir(gte, 2) >> 7;
+		b = gte_ir(gte, 3) >> 7;
+
+		r = r < 0 ? 0 : r > 0x1f ? 0x1f : r;
+		g = g < 0 ? 0 : g > 0x1f ? 0x1f : g;
+		b = b < 0 ? 0 : b > 0x1f ? 0x1f : b;
+
+		return r | (g << 5) | (b << 10);
+	default:
+		return gte->data[reg];
+	}
+}
+
+static u32 gte_cfc(struct lightrec_state *state, u8 reg)
+{
+	return state->gte.ctrl[reg];
+}
+
+static void gte_mtc(struct lightrec_state *state, u8 reg, u32 value)
+{
+	struct lightrec_gte *gte = &state->gte;
+
+	switch (reg) {
+	case 15:
+		gte->data[GTE_SXY0] = gte->data[GTE_SXY0 + 1];
+		gte->data[GTE_SXY0 + 1] = gte->data[GTE_SXY0 + 2];
+		gte->data[GTE_SXY0 + 2] = value;
+		break;
+	case GTE_IRGB:
+		gte->data[GTE_IRGB] = value;
+		gte_set_ir(gte, 1, (value & 0x1f) << 7);
+		gte_set_ir(gte, 2, ((value >> 5) & 0x1f) << 7);
+		gte_set_ir(gte, 3, ((value >> 10) & 0x1f) << 7);
+		break;
+	case GTE_LZCS:
+		gte->data[GTE_LZCS] = value;
+
+		if ((s32)value < 0)
+			value = ~value;
+		gte->data[GTE_LZCR] = value ? __builtin_clz(value) : 32;
+		break;
+	case 29:
+	case GTE_LZCR:
+		/* Read-only */
+		break;
+	default:
+		gte->data[reg] = value;
+		break;
+	}
+}
+
+static void gte_ctc(struct lightrec_state *state, u8 reg, u32 value)
+{
+	struct lightrec_gte *gte = &state->gte;
+
+	if (reg == GTE_FLAG) {
+		value &= 0x7ffff000;
+		if (value & GTE_FLAG_ERROR)
+			value |= BIT(31);
+	} else if (lightrec_gte_ctc_is_signed(reg)) {
+		value = (s32)(s16)value;
+	}
+
+	gte->ctrl[reg] = value;
+}
+
+const struct lightrec_cop_ops lightrec_gte_ops = {
+	.mfc = gte_mfc,
+	.cfc = gte_cfc,
+	.mtc = gte_mtc,
+	.ctc = gte_ctc,
+	.op = gte_op,
+};
+
+void lightrec_gte_init(void)
+{
+	unsigned int i;
+	s32 val;
+
+	for (i = 0; i < ARRAY_SIZE(unr_table); i++) {
+		val = ((0x40000 / (i + 0x100)) + 1) / 2 - 0x101;
+		unr_table[i] = val > 0 ? val : 0;
+	}
+
+	gte_mvmul = lightrec_gte_get_mvmul();
+}
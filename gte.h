@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2020 Paul Cercueil <paul@crapouillou.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef __LIGHTREC_GTE_H__
+#define __LIGHTREC_GTE_H__
+
+#include "lightrec.h"
+
+struct lightrec_state;
+
+typedef void (*lightrec_gte_func_t)(struct lightrec_state *state, u32 op);
+
+/* Matrix * vector + translation kernel; returns false on 44-bit overflow */
+typedef _Bool (*lightrec_gte_mvmul_t)(const s32 m[9], const s32 v[3],
+				      const s32 tr[3], s64 sum[3]);
+
+extern const struct lightrec_cop_ops lightrec_gte_ops;
+
+void lightrec_gte_init(void);
+
+/* Returns the best SIMD kernel supported by the CPU, or NULL */
+lightrec_gte_mvmul_t lightrec_gte_get_mvmul(void);
+
+/* Returns the function implementing the given GTE command */
+lightrec_gte_func_t lightrec_gte_get_func(u32 op);
+
+/* MFC2 / MTC2 of these data registers need special processing, and can't be
+ * emitted as a plain load or store */
+static inline _Bool lightrec_gte_mfc_is_special(u8 reg)
+{
+	return reg == 15 || reg == 28 || reg == 29;
+}
+
+static inline _Bool lightrec_gte_mtc_is_special(u8 reg)
+{
+	return reg == 15 || reg >= 28;
+}
+
+/* Control registers that are sign-extended when written */
+static inline _Bool lightrec_gte_ctc_is_signed(u8 reg)
+{
+	return reg == 4 || reg == 12 || reg == 20 || reg == 26 ||
+		reg == 27 || reg == 29 || reg == 30;
+}
+
+#endif /* __LIGHTREC_GTE_H__ */
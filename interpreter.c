@@ -15,47 +15,110 @@
 #include "disassembler.h"
 #include "interpreter.h"
 #include "lightrec-private.h"
+#include "memmanager.h"
 #include "optimizer.h"
 #include "regcache.h"
 
+#include <errno.h>
 #include <stdbool.h>
 
 struct interpreter;
 
-static u32 int_CP0(struct interpreter *inter);
-static u32 int_CP2(struct interpreter *inter);
-static u32 int_SPECIAL(struct interpreter *inter);
-static u32 int_REGIMM(struct interpreter *inter);
+static u32 int_CP(struct interpreter *inter);
+static u32 int_unimplemented(struct interpreter *inter);
 static u32 int_branch(struct interpreter *inter, u32 pc,
 		      union code code, bool branch);
 
 typedef u32 (*lightrec_int_func_t)(struct interpreter *inter);
 
 static const lightrec_int_func_t int_standard[64];
+static const lightrec_int_func_t int_special[64];
+static const lightrec_int_func_t int_regimm[64];
+static const lightrec_int_func_t int_cp0[64];
+static const lightrec_int_func_t int_cp2_basic[64];
+
+/* Pre-decoded opcode, for the blocks that are run by the interpreter
+ * every time. The array follows the order of the opcode list. */
+struct int_decoded_op {
+	lightrec_int_func_t handler;
+	u32 cycles;
+};
 
 struct interpreter {
 	struct lightrec_state *state;
 	struct block *block;
 	struct opcode *op;
+	const struct int_decoded_op *dec; /* NULL if not pre-decoded */
 	u32 cycles;
 	bool delay_slot;
 };
 
+/* Resolve the handler of an opcode in one go, so that the handlers of the
+ * SPECIAL, REGIMM and coprocessor opcodes are called directly */
+static inline lightrec_int_func_t int_get_handler(union code c)
+{
+	lightrec_int_func_t f;
+
+	switch (c.i.op) {
+	case OP_SPECIAL:
+		f = int_special[c.r.op];
+		break;
+	case OP_REGIMM:
+		f = int_regimm[c.r.rt];
+		break;
+	case OP_CP0:
+		f = int_cp0[c.r.rs];
+		return likely(f) ? f : int_CP;
+	case OP_CP2:
+		if (c.r.op == OP_CP2_BASIC && int_cp2_basic[c.r.rs])
+			return int_cp2_basic[c.r.rs];
+		return int_CP;
+	default:
+		f = int_standard[c.i.op];
+		break;
+	}
+
+	return likely(f) ? f : int_unimplemented;
+}
+
 static inline u32 execute(lightrec_int_func_t func, struct interpreter *inter)
 {
 	return (*func)(inter);
 }
 
-static inline u32 jump_skip(struct interpreter *inter)
+static inline lightrec_int_func_t int_handler(const struct interpreter *inter)
+{
+	if (inter->dec)
+		return inter->dec->handler;
+
+	return int_get_handler(inter->op->c);
+}
+
+static inline u32 int_cycles(const struct interpreter *inter)
+{
+	if (inter->dec)
+		return inter->dec->cycles;
+
+	return lightrec_cycles_of_opcode(inter->op->c);
+}
+
+static inline void int_next_op(struct interpreter *inter)
 {
 	inter->op = inter->op->next;
+	if (inter->dec)
+		inter->dec++;
+}
+
+static inline u32 jump_skip(struct interpreter *inter)
+{
+	int_next_op(inter);
 
-	return execute(int_standard[inter->op->i.op], inter);
+	return execute(int_handler(inter), inter);
 }
 
 static inline u32 jump_next(struct interpreter *inter)
 {
-	inter->cycles += lightrec_cycles_of_opcode(inter->op->c);
+	inter->cycles += int_cycles(inter);
 
 	if (unlikely(inter->delay_slot))
 		return 0;
@@ -65,12 +128,12 @@ static inline u32 jump_next(struct interpreter *inter)
 
 static inline u32 jump_after_branch(struct interpreter *inter)
 {
-	inter->cycles += lightrec_cycles_of_opcode(inter->op->c);
+	inter->cycles += int_cycles(inter);
 
 	if (unlikely(inter->delay_slot))
 		return 0;
 
-	inter->op = inter->op->next;
+	int_next_op(inter);
 
 	return jump_skip(inter);
 }
@@ -226,7 +289,7 @@ static u32 int_delay_slot(struct interpreter *inter, u32 pc, bool branch)
 			inter2.op = &new_op;
 
 			/* Execute the first opcode of the next block */
-			(*int_standard[inter2.op->i.op])(&inter2);
+			execute(int_get_handler(inter2.op->c), &inter2);
 
 			if (save_rs) {
 				new_rs = reg_cache[op->r.rs];
@@ -242,6 +305,7 @@ static u32 int_delay_slot(struct interpreter *inter, u32 pc, bool branch)
 
 	inter2.block = inter->block;
 	inter2.op = op;
+	inter2.dec = inter->dec ? inter->dec + 1 : NULL;
 	inter2.cycles = inter->cycles;
 
 	if (dummy_ld)
@@ -251,7 +315,7 @@ static u32 int_delay_slot(struct interpreter *inter, u32 pc, bool branch)
 	if (branch_at_addr)
 		ds_next_pc = int_branch(&inter2, pc, op_next, branch_taken);
 	else
-		ds_next_pc = (*int_standard[inter2.op->i.op])(&inter2);
+		ds_next_pc = execute(int_handler(&inter2), &inter2);
 
 	if (branch_at_addr && !branch_taken) {
 		/* If the branch at the target of the branch opcode is not
@@ -259,6 +323,9 @@ static u32 int_delay_slot(struct interpreter *inter, u32 pc, bool branch)
 		next_pc = pc + sizeof(u32);
 	} else if (!branch && branch_in_ds) {
 		next_pc = ds_next_pc;
+	} else if (state->builtin_exceptions && is_syscall_or_break(op->c)) {
+		/* The delay slot raised an exception - jump to its vector */
+		next_pc = ds_next_pc;
 	}
 
 	if (save_rs)
@@ -279,13 +346,14 @@ static u32 int_delay_slot(struct interpreter *inter, u32 pc, bool branch)
 		new_op.offset = sizeof(u32);
 		new_op.next = NULL;
 		inter2.op = &new_op;
+		inter2.dec = NULL;
 		inter2.block = NULL;
 
 		inter->cycles += lightrec_cycles_of_opcode(op_next);
 
 		pr_debug("Running delay slot of branch at target of impossible "
 			 "branch\n");
-		(*int_standard[inter2.op->i.op])(&inter2);
+		execute(int_get_handler(inter2.op->c), &inter2);
 	}
 
 	return next_pc;
@@ -469,13 +537,18 @@ static u32 int_ctc(struct interpreter *inter)
 {
 	struct lightrec_state *state = inter->state;
 	const struct opcode *op = inter->op;
+	bool is_sr_cause = op->i.op == OP_CP0 &&
+		(op->r.rd == 12 || op->r.rd == 13);
+	u32 old = state->cop0_regs[op->r.rd];
 
 	lightrec_mtc(state, op->c, state->native_reg_cache[op->r.rt]);
 
 	/* If we have a MTC0 or CTC0 to CP0 register 12 (Status) or 13 (Cause),
 	 * return early so that the emulator will be able to check software
 	 * interrupt status. */
-	if (op->i.op == OP_CP0 && (op->r.rd == 12 || op->r.rd == 13))
+	if (is_sr_cause && (!state->mirror_cop0 ||
+			    lightrec_cop0_write_notifies(op->r.rd, old,
+						state->cop0_regs[op->r.rd])))
 		return inter->block->pc + (op->offset + 1) * sizeof(u32);
 	else
 		return jump_next(inter);
@@ -703,13 +776,19 @@ static u32 int_special_SRAV(struct interpreter *inter)
 
 static u32 int_syscall_break(struct interpreter *inter)
 {
+	u32 pc = inter->block->pc + inter->op->offset * sizeof(u32);
+
+	if (inter->state->builtin_exceptions)
+		return lightrec_enter_exception(inter->state, pc,
+				inter->op->r.op == OP_SPECIAL_BREAK ? 9 : 8,
+				inter->delay_slot);
 
 	if (inter->op->r.op == OP_SPECIAL_BREAK)
 		inter->state->exit_flags |= LIGHTREC_EXIT_BREAK;
 	else
 		inter->state->exit_flags |= LIGHTREC_EXIT_SYSCALL;
 
-	return inter->block->pc + inter->op->offset * sizeof(u32);
+	return pc;
 }
 
 static u32 int_special_MFHI(struct interpreter *inter)
@@ -759,10 +838,14 @@ static u32 int_special_MULT(struct interpreter *inter)
 	s32 rt = reg_cache[inter->op->r.rt];
 	u64 res = (s64)rs * (s64)rt;
 
-	if (!(inter->op->flags & LIGHTREC_MULT32))
+	if (!(inter->op->flags & LIGHTREC_NO_HI))
 		reg_cache[REG_HI] = res >> 32;
 	reg_cache[REG_LO] = res;
 
+	/* Merged MFLO */
+	if (inter->op->r.rd)
+		reg_cache[inter->op->r.rd] = res;
+
 	return jump_next(inter);
 }
 
@@ -773,10 +856,14 @@ static u32 int_special_MULTU(struct interpreter *inter)
 	u32 rt = reg_cache[inter->op->r.rt];
 	u64 res = (u64)rs * (u64)rt;
 
-	if (!(inter->op->flags & LIGHTREC_MULT32))
+	if (!(inter->op->flags & LIGHTREC_NO_HI))
 		reg_cache[REG_HI] = res >> 32;
 	reg_cache[REG_LO] = res;
 
+	/* Merged MFLO */
+	if (inter->op->r.rd)
+		reg_cache[inter->op->r.rd] = res;
+
 	return jump_next(inter);
 }
 
@@ -951,8 +1038,6 @@ static u32 int_META_SYNC(struct interpreter *inter)
 }
 
 static const lightrec_int_func_t int_standard[64] = {
-	[OP_SPECIAL]		= int_SPECIAL,
-	[OP_REGIMM]		= int_REGIMM,
 	[OP_J]			= int_J,
 	[OP_JAL]		= int_JAL,
 	[OP_BEQ]		= int_BEQ,
@@ -967,8 +1052,6 @@ static const lightrec_int_func_t int_standard[64] = {
 	[OP_ORI]		= int_ORI,
 	[OP_XORI]		= int_XORI,
 	[OP_LUI]		= int_LUI,
-	[OP_CP0]		= int_CP0,
-	[OP_CP2]		= int_CP2,
 	[OP_LB]			= int_load,
 	[OP_LH]			= int_load,
 	[OP_LWL]		= int_load,
@@ -1044,50 +1127,13 @@ static const lightrec_int_func_t int_cp2_basic[64] = {
 	[OP_CP2_BASIC_CTC2]	= int_ctc,
 };
 
-static u32 int_SPECIAL(struct interpreter *inter)
-{
-	lightrec_int_func_t f = int_special[inter->op->r.op];
-	if (likely(f))
-		return execute(f, inter);
-	else
-		return int_unimplemented(inter);
-}
-
-static u32 int_REGIMM(struct interpreter *inter)
-{
-	lightrec_int_func_t f = int_regimm[inter->op->r.rt];
-	if (likely(f))
-		return execute(f, inter);
-	else
-		return int_unimplemented(inter);
-}
-
-static u32 int_CP0(struct interpreter *inter)
-{
-	lightrec_int_func_t f = int_cp0[inter->op->r.rs];
-	if (likely(f))
-		return execute(f, inter);
-	else
-		return int_CP(inter);
-}
-
-static u32 int_CP2(struct interpreter *inter)
-{
-	if (inter->op->r.op == OP_CP2_BASIC) {
-		lightrec_int_func_t f = int_cp2_basic[inter->op->r.rs];
-		if (likely(f))
-			return execute(f, inter);
-	}
-
-	return int_CP(inter);
-}
-
 static u32 lightrec_int_op(struct interpreter *inter)
 {
-	return execute(int_standard[inter->op->i.op], inter);
+	return execute(int_handler(inter), inter);
 }
 
-static u32 lightrec_emulate_block_list(struct block *block, struct opcode *op)
+static u32 lightrec_emulate_block_list(struct block *block, struct opcode *op,
+				       const struct int_decoded_op *dec)
 {
 	struct interpreter inter;
 	u32 pc;
@@ -1095,13 +1141,14 @@ static u32 lightrec_emulate_block_list(struct block *block, struct opcode *op)
 	inter.block = block;
 	inter.state = block->state;
 	inter.op = op;
+	inter.dec = dec;
 	inter.cycles = 0;
 	inter.delay_slot = false;
 
 	pc = lightrec_int_op(&inter);
 
 	/* Add the cycles of the last branch */
-	inter.cycles += lightrec_cycles_of_opcode(inter.op->c);
+	inter.cycles += int_cycles(&inter);
 
 	block->state->current_cycle += inter.cycles;
 
@@ -1111,14 +1158,58 @@ static u32 lightrec_emulate_block_list(struct block *block, struct opcode *op)
 u32 lightrec_emulate_block(struct block *block, u32 pc)
 {
 	u32 offset = (kunseg(pc) - kunseg(block->pc)) >> 2;
+	const struct int_decoded_op *dec = block->int_decoded;
 	struct opcode *op;
 
 	for (op = block->opcode_list;
-	     op && (op->offset < offset); op = op->next);
+	     op && (op->offset < offset); op = op->next) {
+		if (dec)
+			dec++;
+	}
 	if (op)
-		return lightrec_emulate_block_list(block, op);
+		return lightrec_emulate_block_list(block, op, dec);
 
 	pr_err("PC 0x%x is outside block at PC 0x%x\n", pc, block->pc);
 
 	return 0;
 }
+
+static unsigned int lightrec_int_nb_ops(const struct block *block)
+{
+	const struct opcode *op;
+	unsigned int nb;
+
+	for (nb = 0, op = block->opcode_list; op; op = op->next)
+		nb++;
+
+	return nb;
+}
+
+int lightrec_predecode_block(struct block *block)
+{
+	struct int_decoded_op *dec;
+	const struct opcode *op;
+	unsigned int nb = lightrec_int_nb_ops(block);
+
+	dec = lightrec_malloc(block->state, MEM_FOR_IR, nb * sizeof(*dec));
+	if (!dec)
+		return -ENOMEM;
+
+	for (op = block->opcode_list, nb = 0; op; op = op->next, nb++) {
+		dec[nb].handler = int_get_handler(op->c);
+		dec[nb].cycles = lightrec_cycles_of_opcode(op->c);
+	}
+
+	block->int_decoded = dec;
+
+	return 0;
+}
+
+void lightrec_free_predecoded(struct block *block)
+{
+	unsigned int nb = lightrec_int_nb_ops(block);
+
+	lightrec_free(block->state, MEM_FOR_IR,
+		      nb * sizeof(*block->int_decoded), block->int_decoded);
+	block->int_decoded = NULL;
+}
@@ -21,4 +21,9 @@ struct block;
 
 u32 lightrec_emulate_block(struct block *block, u32 pc);
 
+/* Resolve the handlers of a block that will always be interpreted once and
+ * for all; must be called after the optimizer ran */
+int lightrec_predecode_block(struct block *block);
+void lightrec_free_predecoded(struct block *block);
+
 #endif /* __LIGHTREC_INTERPRETER_H__ */
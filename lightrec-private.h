@@ -23,6 +23,10 @@
 #include <stdatomic.h>
 #endif
 
+#if ENABLE_COMPILER_STATS
+#include <time.h>
+#endif
+
 #define ARRAY_SIZE(x) (sizeof(x) ? sizeof(x) / sizeof((x)[0]) : 0)
 #define BIT(x) (1 << (x))
 
@@ -56,6 +60,22 @@
 
 #define CODE_LUT_SIZE	((RAM_SIZE + BIOS_SIZE) >> 2)
 
+/* Page table used to find the memory map of a KUNSEG address */
+#define MAP_LUT_SHIFT	12
+#define MAP_LUT_LIMIT	0x20000000
+#define MAP_LUT_SIZE	(MAP_LUT_LIMIT >> MAP_LUT_SHIFT)
+#define MAP_LUT_MULTI	0xfe
+#define MAP_LUT_NONE	0xff
+
+#define MAX_IO_HANDLERS	32
+#define MAX_IO_BATCH	16
+
+#define MAX_SPECULATIVE_BLOCKS	8
+#define PRECOMPILE_STACK_SIZE	256
+
+#define NB_BIOS_VECTORS	3
+#define NB_BIOS_FUNCS	256
+
 /* Definition of jit_state_t (avoids inclusion of <lightning.h>) */
 struct jit_node;
 struct jit_state;
@@ -64,13 +84,17 @@ typedef struct jit_state jit_state_t;
 struct blockcache;
 struct recompiler;
 struct regcache;
+struct int_decoded_op;
 struct opcode;
+struct pageprot;
+struct lightrec_perf;
 struct tinymm;
 
 struct block {
 	jit_state_t *_jit;
 	struct lightrec_state *state;
 	struct opcode *opcode_list;
+	struct int_decoded_op *int_decoded;
 	void (*function)(void);
 	u32 pc;
 #if ENABLE_THREADED_COMPILER
@@ -81,6 +105,11 @@ struct block {
 	u16 nb_ops;
 	const struct lightrec_mem_map *map;
 	struct block *next;
+#if ENABLE_BLOCK_PROFILER
+	u64 exec_count;
+	u64 cycles;
+	u64 compile_time;
+#endif
 };
 
 struct lightrec_branch {
@@ -93,44 +122,91 @@ struct lightrec_branch_target {
 	u32 offset;
 };
 
+struct lightrec_io_handler {
+	u32 addr;
+	u32 length;
+	const struct lightrec_mem_map_ops *ops;
+};
+
+/* Registers of the built-in GTE */
+struct lightrec_gte {
+	u32 data[32];
+	u32 ctrl[32];
+};
+
 struct lightrec_state {
 	u32 native_reg_cache[34];
 	u32 next_pc;
 	u32 current_cycle;
 	u32 target_cycle;
 	u32 exit_flags;
-	struct block *dispatcher, *rw_wrapper, *rw_generic_wrapper,
-		     *mfc_wrapper, *mtc_wrapper, *rfe_wrapper, *cp_wrapper,
+	struct block *dispatcher, *rw_generic_wrapper, *rfe_wrapper,
 		     *syscall_wrapper, *break_wrapper;
-	void *rw_func, *rw_generic_func, *mfc_func, *mtc_func, *rfe_func,
-	     *cp_func, *syscall_func, *break_func;
+	void *rw_generic_func, *rfe_func, *syscall_func, *break_func;
 	struct jit_node *branches[512];
 	struct lightrec_branch local_branches[512];
 	struct lightrec_branch_target targets[512];
 	unsigned int nb_branches;
 	unsigned int nb_local_branches;
 	unsigned int nb_targets;
+	u32 known_regs;
+	u32 known_values[32];
+	struct lightrec_io_handler io_handlers[MAX_IO_HANDLERS];
+	unsigned int nb_io_handlers;
+	lightrec_bios_hook_t bios_hooks[NB_BIOS_VECTORS][NB_BIOS_FUNCS];
+	u8 bios_hooked;
+	struct lightrec_io_write io_batch[MAX_IO_BATCH];
+	unsigned int nb_batched;
+	unsigned int nb_coalesced;
+	_Bool pair_merged;
+	struct lightrec_gte gte;
+	u32 cop0_regs[32];
+	struct lightrec_cop_ops cop0_host_ops;
 	struct tinymm *tinymm;
 	struct blockcache *block_cache;
 	struct regcache *reg_cache;
 	struct recompiler *rec;
+	struct pageprot *pageprot;
+	struct lightrec_perf *perf;
 	void (*eob_wrapper_func)(void);
 	void (*get_next_block)(void);
 	struct lightrec_ops ops;
 	unsigned int cycles;
 	unsigned int nb_maps;
 	const struct lightrec_mem_map *maps;
+	const struct lightrec_mem_map **map_targets;
 	uintptr_t offset_ram, offset_bios, offset_scratch;
+	uintptr_t sp_host;
+	u32 sp_tag;
 	_Bool mirrors_mapped;
 	_Bool invalidate_from_dma_only;
+	_Bool builtin_gte;
+	_Bool mirror_cop0;
+	_Bool builtin_exceptions;
+	_Bool interpreter_only;
+	_Bool speculative_compile;
+#if ENABLE_BLOCK_PROFILER
+	struct block *profiled_block;
+	u32 profiled_start;
+#endif
+#if ENABLE_COMPILER_STATS
+	struct lightrec_compiler_stats compiler_stats;
+#endif
+	u8 map_lut[MAP_LUT_SIZE];
 	void *code_lut[];
 };
 
 u32 lightrec_rw(struct lightrec_state *state, union code op,
 		u32 addr, u32 data, u16 *flags);
+void lightrec_rw_cb(struct lightrec_state *state, union code op);
+u32 lightrec_bulk_loop(struct lightrec_state *state, u32 regs,
+		       u32 offsets, u32 misc, s32 cycles_left);
 
 void lightrec_free_block(struct block *block);
 
+const struct lightrec_mem_map *
+lightrec_get_map(struct lightrec_state *state, u32 kaddr);
+
 static inline u32 kunseg(u32 addr)
 {
 	if (unlikely(addr >= 0xa0000000))
@@ -147,6 +223,56 @@ static inline u32 lut_offset(u32 pc)
 		return (pc & (RAM_SIZE - 1)) >> 2; // RAM
 }
 
+/* With the COP0 registers mirrored, returns true if a write must be
+ * forwarded to the host */
+static inline _Bool lightrec_cop0_write_notifies(u8 reg, u32 old, u32 value)
+{
+	switch (reg) {
+	case 8: /* BadVaddr */
+	case 14: /* EPC */
+		return 0;
+	case 12: /* SR: IEc, interrupt mask, cache isolation */
+		return !!((old ^ value) & (BIT(0) | 0xff00 | BIT(16)));
+	case 13: /* Cause: software interrupts */
+		return !!((old ^ value) & 0x300);
+	default:
+		return 1;
+	}
+}
+
+u64 lightrec_get_time_ns(void);
+
+#if ENABLE_COMPILER_STATS
+static inline unsigned int lightrec_stats_bucket(u64 val)
+{
+	unsigned int bucket = val ? 64 - __builtin_clzll(val) : 0;
+
+	if (bucket >= LIGHTREC_STATS_HIST_SIZE)
+		bucket = LIGHTREC_STATS_HIST_SIZE - 1;
+
+	return bucket;
+}
+
+/* Account for the time elapsed since 'start' */
+static inline void lightrec_stats_add(struct lightrec_stage_stats *stats,
+				      u64 start)
+{
+	u64 ns = lightrec_get_time_ns() - start;
+
+	stats->count++;
+	stats->total_ns += ns;
+	if (ns > stats->max_ns)
+		stats->max_ns = ns;
+
+	stats->histogram[lightrec_stats_bucket(ns / 1000)]++;
+}
+#endif
+
+void lightrec_cop0_notify(struct lightrec_state *state,
+			  u8 reg, u32 value, _Bool ctc);
+u32 lightrec_enter_exception(struct lightrec_state *state, u32 pc, u32 excode,
+			     _Bool delay_slot);
+
 void lightrec_mtc(struct lightrec_state *state, union code op, u32 data);
 u32 lightrec_mfc(struct lightrec_state *state, union code op);
 
@@ -12,17 +12,23 @@
  * Lesser General Public License for more details.
  */
 
+/* For clock_gettime() */
+#define _POSIX_C_SOURCE 199309L
+
 #include "blockcache.h"
 #include "config.h"
 #include "debug.h"
 #include "disassembler.h"
 #include "emitter.h"
+#include "gte.h"
 #include "interpreter.h"
 #include "lightrec.h"
 #include "memmanager.h"
 #include "recompiler.h"
 #include "regcache.h"
 #include "optimizer.h"
+#include "pageprot.h"
+#include "perf.h"
 
 #include <errno.h>
 #include <lightning.h>
@@ -33,6 +39,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <string.h>
+#include <time.h>
 #if ENABLE_TINYMM
 #include <tinymm.h>
 #endif
@@ -86,11 +93,31 @@ static void lightrec_invalidate_map(struct lightrec_state *state,
 		state->code_lut[lut_offset(addr)] = NULL;
 }
 
-static const struct lightrec_mem_map *
+const struct lightrec_mem_map *
 lightrec_get_map(struct lightrec_state *state, u32 kaddr)
 {
+	const struct lightrec_mem_map *map;
 	unsigned int i;
+	u8 idx;
+
+	if (likely(kaddr < MAP_LUT_LIMIT)) {
+		idx = state->map_lut[kaddr >> MAP_LUT_SHIFT];
+
+		if (idx == MAP_LUT_NONE)
+			return NULL;
+
+		if (likely(idx != MAP_LUT_MULTI)) {
+			/* Only one map covers this page */
+			map = &state->maps[idx];
+
+			if (kaddr >= map->pc && kaddr < map->pc + map->length)
+				return map;
+
+			return NULL;
+		}
+	}
 
+	/* Slow path, for pages shared by multiple maps */
 	for (i = 0; i < state->nb_maps; i++) {
 		const struct lightrec_mem_map *map = &state->maps[i];
 
@@ -101,6 +128,56 @@ lightrec_get_map(struct lightrec_state *state, u32 kaddr)
 	return NULL;
 }
 
+static inline const struct lightrec_mem_map *
+lightrec_map_target(struct lightrec_state *state,
+		    const struct lightrec_mem_map *map)
+{
+	return state->map_targets[map - state->maps];
+}
+
+static int lightrec_init_map_lut(struct lightrec_state *state)
+{
+	const struct lightrec_mem_map *map, *target;
+	unsigned int i, page, first, last;
+
+	state->map_targets = lightrec_malloc(state, MEM_FOR_LIGHTREC,
+					     sizeof(*state->map_targets) *
+					     state->nb_maps);
+	if (!state->map_targets)
+		return -ENOMEM;
+
+	memset(state->map_lut, MAP_LUT_NONE, sizeof(state->map_lut));
+
+	for (i = 0; i < state->nb_maps; i++) {
+		map = &state->maps[i];
+
+		/* Resolve the mirrors once and for all */
+		for (target = map; target->mirror_of; )
+			target = target->mirror_of;
+
+		state->map_targets[i] = target;
+
+		if (!map->length || map->pc >= MAP_LUT_LIMIT)
+			continue;
+
+		first = map->pc >> MAP_LUT_SHIFT;
+		last = (map->pc + map->length - 1) >> MAP_LUT_SHIFT;
+
+		if (last >= MAP_LUT_SIZE)
+			last = MAP_LUT_SIZE - 1;
+
+		for (page = first; page <= last; page++) {
+			if (state->map_lut[page] == MAP_LUT_NONE &&
+			    i < MAP_LUT_MULTI)
+				state->map_lut[page] = i;
+			else
+				state->map_lut[page] = MAP_LUT_MULTI;
+		}
+	}
+
+	return 0;
+}
+
 u32 lightrec_rw(struct lightrec_state *state, union code op,
 		u32 addr, u32 data, u16 *flags)
 {
@@ -127,8 +204,7 @@ u32 lightrec_rw(struct lightrec_state *state, union code op,
 		return lightrec_rw_ops(state, op, map->ops, addr, data);
 	}
 
-	while (map->mirror_of)
-		map = map->mirror_of;
+	map = lightrec_map_target(state, map);
 
 	if (flags)
 		*flags |= LIGHTREC_DIRECT_IO;
@@ -230,11 +306,105 @@ static void lightrec_rw_helper(struct lightrec_state *state,
 	}
 }
 
-static void lightrec_rw_cb(struct lightrec_state *state, union code op)
+void lightrec_rw_cb(struct lightrec_state *state, union code op)
 {
 	lightrec_rw_helper(state, op, NULL);
 }
 
+/* Host address of the range [addr, addr + len), or NULL if it is not
+ * contained in a single directly accessible map */
+static void * lightrec_host_range(struct lightrec_state *state,
+				  u32 addr, u32 len)
+{
+	const struct lightrec_mem_map *map;
+	u32 kaddr = kunseg(addr);
+
+	map = lightrec_get_map(state, kaddr);
+	if (!map || map->ops || kaddr - map->pc + len > map->length)
+		return NULL;
+
+	return (void *)((uintptr_t) lightrec_map_target(state, map)->address
+			+ kaddr - map->pc);
+}
+
+u32 lightrec_bulk_loop(struct lightrec_state *state, u32 regs,
+		       u32 offsets, u32 misc, s32 cycles_left)
+{
+	u32 *r = state->native_reg_cache;
+	u8 dst = regs & 0x1f, src = (regs >> 5) & 0x1f,
+	   data = (regs >> 10) & 0x1f, cnt = (regs >> 15) & 0x1f,
+	   end = (regs >> 20) & 0x1f;
+	bool cnt_pre = (regs >> 25) & 1;
+	s16 dst_off = (s16) offsets, src_off = (s16)(offsets >> 16);
+	s16 step = (s16) misc;
+	u32 cycles = misc >> 16, dst_addr, src_addr, len, val, i;
+	s64 diff, iters;
+	u32 *d;
+	const u32 *s = NULL;
+
+	if (cycles_left <= 0)
+		return 0;
+
+	/* Number of iterations left before the counter reaches the end
+	 * value. The last one is always left to the recompiled loop body. */
+	diff = (s64)(s32)(r[end] - r[cnt]);
+	if (diff % step)
+		return 0;
+
+	iters = diff / step - cnt_pre;
+
+	/* Don't run for more cycles than the block is allowed to */
+	if (iters > (cycles_left - 1) / cycles)
+		iters = (cycles_left - 1) / cycles;
+	if (iters <= 0)
+		return 0;
+
+	len = (u32) iters << 2;
+	dst_addr = r[dst] + dst_off;
+	if (dst_addr & 0x3)
+		return 0;
+
+	d = lightrec_host_range(state, dst_addr, len);
+	if (!d)
+		return 0;
+
+	if (src) {
+		src_addr = r[src] + src_off;
+		if (src_addr & 0x3)
+			return 0;
+
+		s = lightrec_host_range(state, src_addr, len);
+		if (!s)
+			return 0;
+	}
+
+	pr_debug("Running %s loop at 0x%08x for %u iterations\n",
+		 src ? "copy" : "fill", dst_addr, (u32) iters);
+
+	if (src) {
+		/* Word by word, as the ranges may overlap */
+		for (i = 0; i < (u32) iters; i++)
+			d[i] = s[i];
+
+		r[data] = LE32TOH(s[iters - 1]);
+		r[src] += len;
+	} else {
+		val = HTOLE32(r[data]);
+
+		for (i = 0; i < (u32) iters; i++)
+			d[i] = val;
+	}
+
+	if (!state->invalidate_from_dma_only)
+		lightrec_invalidate(state, dst_addr, len);
+
+	r[dst] += len;
+	if (cnt != dst && cnt != src)
+		r[cnt] += step * (u32) iters;
+
+	return (u32) iters * cycles;
+}
+
 static void lightrec_rw_generic_cb(struct lightrec_state *state,
 				   struct opcode *op, struct block *block)
 {
@@ -271,14 +441,6 @@ u32 lightrec_mfc(struct lightrec_state *state, union code op)
 	return (*func)(state, op.r.rd);
 }
 
-static void lightrec_mfc_cb(struct lightrec_state *state, union code op)
-{
-	u32 rt = lightrec_mfc(state, op);
-
-	if (op.r.rt)
-		state->native_reg_cache[op.r.rt] = rt;
-}
-
 void lightrec_mtc(struct lightrec_state *state, union code op, u32 data)
 {
 	bool is_ctc = (op.i.op == OP_CP0 && op.r.rs == OP_CP0_CTC0) ||
@@ -299,11 +461,96 @@ void lightrec_mtc(struct lightrec_state *state, union code op, u32 data)
 	(*func)(state, op.r.rd, data);
 }
 
-static void lightrec_mtc_cb(struct lightrec_state *state, union code op)
+static bool lightrec_interrupt_pending(const struct lightrec_state *state)
+{
+	u32 status = state->cop0_regs[12], cause = state->cop0_regs[13];
+
+	return (status & 0x1) && (status & cause & 0xff00);
+}
+
+void lightrec_cop0_notify(struct lightrec_state *state,
+			  u8 reg, u32 value, bool ctc)
 {
-	lightrec_mtc(state, op, state->native_reg_cache[op.r.rt]);
+	if (ctc)
+		state->cop0_host_ops.ctc(state, reg, value);
+	else
+		state->cop0_host_ops.mtc(state, reg, value);
+
+	/* The write may have unmasked a pending interrupt */
+	if (state->builtin_exceptions && lightrec_interrupt_pending(state))
+		lightrec_set_exit_flags(state, LIGHTREC_EXIT_CHECK_INTERRUPT);
 }
 
+u32 lightrec_enter_exception(struct lightrec_state *state, u32 pc, u32 excode,
+			     bool delay_slot)
+{
+	u32 *regs = state->cop0_regs;
+	u32 status = regs[12];
+
+	regs[13] = (regs[13] & ~0x8000007c) | (excode << 2);
+	regs[14] = pc;
+
+	/* From a delay slot, EPC points to the branch and Cause.BD is set */
+	if (delay_slot) {
+		regs[13] |= 0x80000000;
+		regs[14] = pc - 4;
+	}
+
+	/* Push the KU/IE mode stack */
+	regs[12] = (status & ~0x3f) | ((status << 2) & 0x3f);
+
+	return (status & BIT(22)) ? 0xbfc00180 : 0x80000080;
+}
+
+static u32 lightrec_take_interrupt(struct lightrec_state *state, u32 pc)
+{
+	union code op = lightrec_read_opcode(state, pc);
+
+	/* The hardware executes a GTE command before taking the interrupt,
+	 * and the BIOS handler skips it when returning */
+	if (op.i.op == OP_CP2 && (op.opcode & BIT(25)))
+		state->ops.cop2_ops.op(state, op.opcode & ~BIT(25));
+
+	return lightrec_enter_exception(state, pc, 0, false);
+}
+
+static u32 lightrec_cop0_mfc(struct lightrec_state *state, u8 reg)
+{
+	return state->cop0_regs[reg];
+}
+
+static void lightrec_cop0_write(struct lightrec_state *state,
+				u8 reg, u32 value, bool ctc)
+{
+	u32 old = state->cop0_regs[reg], new = value;
+
+	/* Only the software interrupt bits of Cause are writable */
+	if (reg == 13)
+		new = (old & ~0x300) | (value & 0x300);
+
+	state->cop0_regs[reg] = new;
+
+	if (lightrec_cop0_write_notifies(reg, old, new))
+		lightrec_cop0_notify(state, reg, value, ctc);
+}
+
+static void lightrec_cop0_mtc(struct lightrec_state *state, u8 reg, u32 value)
+{
+	lightrec_cop0_write(state, reg, value, false);
+}
+
+static void lightrec_cop0_ctc(struct lightrec_state *state, u8 reg, u32 value)
+{
+	lightrec_cop0_write(state, reg, value, true);
+}
+
+static const struct lightrec_cop_ops lightrec_cop0_mirror_ops = {
+	.mfc = lightrec_cop0_mfc,
+	.cfc = lightrec_cop0_mfc,
+	.mtc = lightrec_cop0_mtc,
+	.ctc = lightrec_cop0_ctc,
+};
+
 static void lightrec_rfe_cb(struct lightrec_state *state, union code op)
 {
 	u32 status;
@@ -318,31 +565,118 @@ static void lightrec_rfe_cb(struct lightrec_state *state, union code op)
 	state->ops.cop0_ops.ctc(state, 12, status);
 }
 
-static void lightrec_cp_cb(struct lightrec_state *state, union code op)
+static void lightrec_syscall_cb(struct lightrec_state *state, union code op)
+{
+	lightrec_set_exit_flags(state, LIGHTREC_EXIT_SYSCALL);
+}
+
+static void lightrec_break_cb(struct lightrec_state *state, union code op)
 {
-	void (*func)(struct lightrec_state *, u32);
+	lightrec_set_exit_flags(state, LIGHTREC_EXIT_BREAK);
+}
 
-	if ((op.opcode >> 25) & 1)
-		func = state->ops.cop2_ops.op;
-	else
-		func = state->ops.cop0_ops.op;
+/* Create the block at the given PC if it doesn't exist yet. Returns the new
+ * block, or NULL. The block is not queued for compilation, as the compiler
+ * may free its opcode list: see lightrec_speculate_compile(). */
+static struct block * lightrec_speculate_block(struct lightrec_state *state,
+					       u32 pc)
+{
+	struct block *block = lightrec_find_block(state->block_cache, pc);
+
+	if (block)
+		return NULL;
+
+	block = lightrec_precompile_block(state, pc);
+	if (!block)
+		return NULL;
 
-	(*func)(state, op.opcode);
+	lightrec_register_block(state->block_cache, block);
+
+	if (ENABLE_PAGE_PROTECTION && state->pageprot)
+		lightrec_pageprot_block(state->pageprot, block);
+
+	return block;
 }
 
-static void lightrec_syscall_cb(struct lightrec_state *state, union code op)
+/* Compile a speculated block ahead of time, at low priority. Only the blocks
+ * that have nothing to profile are compiled; the other ones must run through
+ * the first pass to get their I/O tags, or they would be compiled twice. */
+static void lightrec_speculate_compile(struct lightrec_state *state,
+				       struct block *block)
 {
-	lightrec_set_exit_flags(state, LIGHTREC_EXIT_SYSCALL);
+	if (state->interpreter_only ||
+	    !(block->flags & BLOCK_FULLY_TAGGED) ||
+	    (block->flags & BLOCK_NEVER_COMPILE))
+		return;
+
+	if (ENABLE_THREADED_COMPILER)
+		lightrec_recompiler_add_speculative(state->rec, block);
+	else
+		lightrec_compile_block(block);
 }
 
-static void lightrec_break_cb(struct lightrec_state *state, union code op)
+/* Get the static successors of a block: targets of its jumps and branches,
+ * and return addresses of its calls */
+static unsigned int lightrec_get_successors(const struct block *block,
+					    u32 *targets, unsigned int max)
 {
-	lightrec_set_exit_flags(state, LIGHTREC_EXIT_BREAK);
+	const struct opcode *op;
+	unsigned int nb = 0;
+	u32 pc;
+
+	for (op = block->opcode_list; op && nb < max; op = op->next) {
+		if (op->flags & (LIGHTREC_EMULATE_BRANCH |
+				 LIGHTREC_LOCAL_BRANCH))
+			continue;
+
+		pc = block->pc + (op->offset << 2);
+
+		switch (op->i.op) {
+		case OP_JAL:
+			targets[nb++] = pc + 8;
+		case OP_J: /* fall-through */
+			if (nb < max)
+				targets[nb++] = (pc & 0xf0000000) |
+					(op->j.imm << 2);
+			break;
+		case OP_SPECIAL:
+			if (op->r.op == OP_SPECIAL_JALR)
+				targets[nb++] = pc + 8;
+			break;
+		case OP_BEQ:
+		case OP_BNE:
+		case OP_BLEZ:
+		case OP_BGTZ:
+		case OP_REGIMM:
+		case OP_META_BEQZ:
+		case OP_META_BNEZ:
+			targets[nb++] = pc + 4 + ((s16)op->i.imm << 2);
+			break;
+		default:
+			break;
+		}
+	}
+
+	return nb;
+}
+
+static void lightrec_speculate_successors(struct lightrec_state *state,
+					  const u32 *targets, unsigned int nb)
+{
+	struct block *block;
+
+	while (nb--) {
+		block = lightrec_speculate_block(state, targets[nb]);
+		if (block)
+			lightrec_speculate_compile(state, block);
+	}
 }
 
 struct block * lightrec_get_block(struct lightrec_state *state, u32 pc)
 {
 	struct block *block = lightrec_find_block(state->block_cache, pc);
+	u32 targets[MAX_SPECULATIVE_BLOCKS];
+	unsigned int nb = 0;
 
 	if (block && lightrec_block_is_outdated(block)) {
 		pr_debug("Block at PC 0x%08x is outdated!\n", block->pc);
@@ -366,11 +700,67 @@ struct block * lightrec_get_block(struct lightrec_state *state, u32 pc)
 		}
 
 		lightrec_register_block(state->block_cache, block);
+
+		if (ENABLE_PAGE_PROTECTION && state->pageprot)
+			lightrec_pageprot_block(state->pageprot, block);
+
+		/* The compiler may free the opcode list once the block is
+		 * queued, so gather the successors first */
+		if (ENABLE_THREADED_COMPILER && state->speculative_compile)
+			nb = lightrec_get_successors(block, targets,
+						     ARRAY_SIZE(targets));
+
+		/* Nothing to profile - start compiling right away */
+		if (ENABLE_THREADED_COMPILER && !state->interpreter_only &&
+		    (block->flags & BLOCK_FULLY_TAGGED) &&
+		    !(block->flags & BLOCK_NEVER_COMPILE))
+			lightrec_recompiler_add(state->rec, block);
+
+		lightrec_speculate_successors(state, targets, nb);
 	}
 
 	return block;
 }
 
+/* Index of the BIOS vector at the given address, or -1 */
+static int lightrec_bios_vector(u32 pc)
+{
+	switch (kunseg(pc)) {
+	case 0xa0:
+		return 0;
+	case 0xb0:
+		return 1;
+	case 0xc0:
+		return 2;
+	default:
+		return -1;
+	}
+}
+
+static bool lightrec_run_bios_hook(struct lightrec_state *state, u32 *pc)
+{
+	lightrec_bios_hook_t hook;
+	u32 func = state->native_reg_cache[9];
+	int vector = lightrec_bios_vector(*pc);
+	s32 cycles;
+
+	if (vector < 0 || func >= NB_BIOS_FUNCS)
+		return false;
+
+	hook = state->bios_hooks[vector][func];
+	if (!hook)
+		return false;
+
+	cycles = hook(state, state->native_reg_cache);
+	if (cycles < 0)
+		return false;
+
+	state->current_cycle += cycles;
+	*pc = state->native_reg_cache[31];
+
+	return true;
+}
+
 static void * get_next_block_func(struct lightrec_state *state, u32 pc)
 {
 	struct block *block;
@@ -378,6 +768,17 @@ static void * get_next_block_func(struct lightrec_state *state, u32 pc)
 	void *func;
 
 	for (;;) {
+		if (unlikely(state->bios_hooked) &&
+		    lightrec_run_bios_hook(state, &pc)) {
+			if (state->exit_flags != LIGHTREC_EXIT_NORMAL ||
+			    state->current_cycle >= state->target_cycle) {
+				state->next_pc = pc;
+				return NULL;
+			}
+
+			continue;
+		}
+
 		func = state->code_lut[lut_offset(pc)];
 		if (func && func != state->get_next_block)
 			return func;
@@ -412,9 +813,11 @@ static void * get_next_block_func(struct lightrec_state *state, u32 pc)
 		if (likely(func))
 			return func;
 
-		/* Block wasn't compiled yet - run the interpreter */
+		/* Block wasn't compiled yet - run the interpreter, unless it
+		 * has nothing to profile */
 		if (!ENABLE_THREADED_COMPILER &&
-		    ((ENABLE_FIRST_PASS && likely(!should_recompile)) ||
+		    ((ENABLE_FIRST_PASS && likely(!should_recompile) &&
+		      !(block->flags & BLOCK_FULLY_TAGGED)) ||
 		     unlikely(block->flags & BLOCK_NEVER_COMPILE)))
 			pc = lightrec_emulate_block(block, pc);
 
@@ -556,6 +959,36 @@ err_no_mem:
 	return NULL;
 }
 
+/* Monotonic time, in nanoseconds */
+u64 lightrec_get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#if ENABLE_BLOCK_PROFILER
+/* Called by the dispatcher each time a block exits */
+static void lightrec_profile_block(struct lightrec_state *state, s32 cycles)
+{
+	struct block *block = state->profiled_block;
+
+	if (!block)
+		return;
+
+	block->exec_count++;
+
+	/* Compare absolute cycle counts: forced exits (see
+	 * lightrec_set_exit_flags()) move the target, so the remaining cycles
+	 * alone can't be compared with the ones at entry */
+	block->cycles += state->target_cycle - cycles - state->profiled_start;
+
+	state->profiled_block = NULL;
+}
+#endif
+
 static struct block * generate_dispatcher(struct lightrec_state *state)
 {
 	struct block *block;
@@ -603,6 +1036,13 @@ static struct block * generate_dispatcher(struct lightrec_state *state)
 	 * LIGHTREC_REG_CYCLE */
 	addr2 = jit_indirect();
 
+#if ENABLE_BLOCK_PROFILER
+	jit_prepare();
+	jit_pushargr(LIGHTREC_REG_STATE);
+	jit_pushargr(LIGHTREC_REG_CYCLE);
+	jit_finishi(&lightrec_profile_block);
+#endif
+
 	/* Jump to end if state->target_cycle < state->current_cycle */
 	to_end = jit_blei(LIGHTREC_REG_CYCLE, 0);
 
@@ -624,20 +1064,19 @@ static struct block * generate_dispatcher(struct lightrec_state *state)
 	/* Slow path: call C function get_next_block_func() */
 	jit_patch(to_c);
 
-	if (ENABLE_FIRST_PASS) {
-		/* We may call the interpreter - update state->current_cycle */
-		jit_ldxi_i(JIT_R2, LIGHTREC_REG_STATE,
-			   offsetof(struct lightrec_state, target_cycle));
-		jit_subr(JIT_R1, JIT_R2, LIGHTREC_REG_CYCLE);
-		jit_stxi_i(offsetof(struct lightrec_state, current_cycle),
-			   LIGHTREC_REG_STATE, JIT_R1);
-	}
-
 	/* The code LUT will be set to this address when the block at the target
 	 * PC has been preprocessed but not yet compiled by the threaded
-	 * recompiler */
+	 * recompiler, or is a hooked BIOS vector */
 	addr = jit_indirect();
 
+	/* We may call the interpreter or a BIOS hook - update
+	 * state->current_cycle */
+	jit_ldxi_i(JIT_R2, LIGHTREC_REG_STATE,
+		   offsetof(struct lightrec_state, target_cycle));
+	jit_subr(JIT_R1, JIT_R2, LIGHTREC_REG_CYCLE);
+	jit_stxi_i(offsetof(struct lightrec_state, current_cycle),
+		   LIGHTREC_REG_STATE, JIT_R1);
+
 	/* Get the next block */
 	jit_prepare();
 	jit_pushargr(LIGHTREC_REG_STATE);
@@ -645,15 +1084,13 @@ static struct block * generate_dispatcher(struct lightrec_state *state)
 	jit_finishi(&get_next_block_func);
 	jit_retval(JIT_R0);
 
-	if (ENABLE_FIRST_PASS) {
-		/* The interpreter may have updated state->current_cycle and
-		 * state->target_cycle - recalc the delta */
-		jit_ldxi_i(JIT_R1, LIGHTREC_REG_STATE,
-			   offsetof(struct lightrec_state, current_cycle));
-		jit_ldxi_i(JIT_R2, LIGHTREC_REG_STATE,
-			   offsetof(struct lightrec_state, target_cycle));
-		jit_subr(LIGHTREC_REG_CYCLE, JIT_R2, JIT_R1);
-	}
+	/* The interpreter or a BIOS hook may have updated
+	 * state->current_cycle and state->target_cycle - recalc the delta */
+	jit_ldxi_i(JIT_R1, LIGHTREC_REG_STATE,
+		   offsetof(struct lightrec_state, current_cycle));
+	jit_ldxi_i(JIT_R2, LIGHTREC_REG_STATE,
+		   offsetof(struct lightrec_state, target_cycle));
+	jit_subr(LIGHTREC_REG_CYCLE, JIT_R2, JIT_R1);
 
 	/* If we get non-NULL, loop */
 	jit_patch_at(jit_bnei(JIT_R0, 0), loop);
@@ -711,15 +1148,47 @@ union code lightrec_read_opcode(struct lightrec_state *state, u32 pc)
 	const struct lightrec_mem_map *map = lightrec_get_map(state, kunseg_pc);
 
 	addr = kunseg_pc - map->pc;
-
-	while (map->mirror_of)
-		map = map->mirror_of;
+	map = lightrec_map_target(state, map);
 
 	code = map->address + addr;
 
 	return (union code) *code;
 }
 
+static bool lightrec_block_is_fully_tagged(struct block *block)
+{
+	struct opcode *op;
+
+	for (op = block->opcode_list; op; op = op->next) {
+		/* Verify that all load/stores of the opcode list
+		 * Check all loads/stores of the opcode list and mark the
+		 * block as fully compiled if they all have been tagged. */
+		switch (op->c.i.op) {
+		case OP_LB:
+		case OP_LH:
+		case OP_LWL:
+		case OP_LW:
+		case OP_LBU:
+		case OP_LHU:
+		case OP_LWR:
+		case OP_SB:
+		case OP_SH:
+		case OP_SWL:
+		case OP_SW:
+		case OP_SWR:
+		case OP_LWC2:
+		case OP_SWC2:
+			if (!(op->flags & (LIGHTREC_DIRECT_IO |
+					   LIGHTREC_HW_IO)))
+				return false;
+		default: /* fall-through */
+			continue;
+		}
+	}
+
+	return true;
+}
+
 static struct block * lightrec_precompile_block(struct lightrec_state *state,
 						u32 pc)
 {
@@ -729,14 +1198,16 @@ static struct block * lightrec_precompile_block(struct lightrec_state *state,
 	u32 addr, kunseg_pc = kunseg(pc);
 	const struct lightrec_mem_map *map = lightrec_get_map(state, kunseg_pc);
 	unsigned int length;
+#if ENABLE_COMPILER_STATS
+	struct lightrec_stage_stats *stages = state->compiler_stats.stages;
+	u64 start;
+#endif
 
 	if (!map)
 		return NULL;
 
 	addr = kunseg_pc - map->pc;
-
-	while (map->mirror_of)
-		map = map->mirror_of;
+	map = lightrec_map_target(state, map);
 
 	code = map->address + addr;
 
@@ -746,7 +1217,16 @@ static struct block * lightrec_precompile_block(struct lightrec_state *state,
 		return NULL;
 	}
 
+#if ENABLE_COMPILER_STATS
+	start = lightrec_get_time_ns();
+#endif
+
 	list = lightrec_disassemble(state, code, &length);
+
+#if ENABLE_COMPILER_STATS
+	lightrec_stats_add(&stages[LIGHTREC_STAGE_DISASSEMBLE], start);
+#endif
+
 	if (!list) {
 		lightrec_free(state, MEM_FOR_IR, sizeof(*block), block);
 		return NULL;
@@ -757,17 +1237,31 @@ static struct block * lightrec_precompile_block(struct lightrec_state *state,
 	block->_jit = NULL;
 	block->function = NULL;
 	block->opcode_list = list;
+	block->int_decoded = NULL;
 	block->map = map;
 	block->next = NULL;
 	block->flags = 0;
 	block->code_size = 0;
 #if ENABLE_THREADED_COMPILER
 	block->op_list_freed = (atomic_flag)ATOMIC_FLAG_INIT;
+#endif
+#if ENABLE_BLOCK_PROFILER
+	block->exec_count = 0;
+	block->cycles = 0;
+	block->compile_time = 0;
 #endif
 	block->nb_ops = length / sizeof(u32);
 
+#if ENABLE_COMPILER_STATS
+	start = lightrec_get_time_ns();
+#endif
+
 	lightrec_optimize(block);
 
+#if ENABLE_COMPILER_STATS
+	lightrec_stats_add(&stages[LIGHTREC_STAGE_OPTIMIZE], start);
+#endif
+
 	length = block->nb_ops * sizeof(u32);
 
 	lightrec_register(MEM_FOR_MIPS_CODE, length);
@@ -784,41 +1278,17 @@ static struct block * lightrec_precompile_block(struct lightrec_state *state,
 	if (list->flags & LIGHTREC_EMULATE_BRANCH)
 		block->flags |= BLOCK_NEVER_COMPILE;
 
-	return block;
-}
-
-static bool lightrec_block_is_fully_tagged(struct block *block)
-{
-	struct opcode *op;
+	/* Not fatal - the interpreter decodes the opcodes on the fly
+	 * otherwise */
+	if ((block->flags & BLOCK_NEVER_COMPILE) || state->interpreter_only)
+		lightrec_predecode_block(block);
 
-	for (op = block->opcode_list; op; op = op->next) {
-		/* Verify that all load/stores of the opcode list
-		 * Check all loads/stores of the opcode list and mark the
-		 * block as fully compiled if they all have been tagged. */
-		switch (op->c.i.op) {
-		case OP_LB:
-		case OP_LH:
-		case OP_LWL:
-		case OP_LW:
-		case OP_LBU:
-		case OP_LHU:
-		case OP_LWR:
-		case OP_SB:
-		case OP_SH:
-		case OP_SWL:
-		case OP_SW:
-		case OP_SWR:
-		case OP_LWC2:
-		case OP_SWC2:
-			if (!(op->flags & (LIGHTREC_DIRECT_IO |
-					   LIGHTREC_HW_IO)))
-				return false;
-		default: /* fall-through */
-			continue;
-		}
-	}
+	/* All the loads/stores have been tagged by the optimizer (or there
+	 * are none); the first pass would not profile anything */
+	if (lightrec_block_is_fully_tagged(block))
+		block->flags |= BLOCK_FULLY_TAGGED;
 
-	return true;
+	return block;
 }
 
 int lightrec_compile_block(struct block *block)
@@ -832,6 +1302,20 @@ int lightrec_compile_block(struct block *block)
 	jit_word_t code_size;
 	unsigned int i, j;
 	u32 next_pc;
+#if ENABLE_BLOCK_PROFILER
+	u64 compile_start;
+#endif
+#if ENABLE_COMPILER_STATS
+	struct lightrec_stage_stats *stages = state->compiler_stats.stages;
+	u64 start;
+#endif
+
+#if ENABLE_BLOCK_PROFILER
+	compile_start = lightrec_get_time_ns();
+#endif
+#if ENABLE_COMPILER_STATS
+	start = lightrec_get_time_ns();
+#endif
 
 	fully_tagged = lightrec_block_is_fully_tagged(block);
 	if (fully_tagged)
@@ -848,15 +1332,43 @@ int lightrec_compile_block(struct block *block)
 	state->nb_branches = 0;
 	state->nb_local_branches = 0;
 	state->nb_targets = 0;
+	state->known_regs = 0;
+	state->nb_batched = 0;
+	state->nb_coalesced = 0;
+	state->pair_merged = false;
 
 	jit_prolog();
 	jit_tramp(256);
 
+#if ENABLE_BLOCK_PROFILER
+	/* Remember the block and the cycle count at entry, the dispatcher
+	 * will account for them when the block exits */
+	jit_movi(JIT_R0, (uintptr_t) block);
+	jit_stxi(offsetof(struct lightrec_state, profiled_block),
+		 LIGHTREC_REG_STATE, JIT_R0);
+	jit_ldxi_i(JIT_R0, LIGHTREC_REG_STATE,
+		   offsetof(struct lightrec_state, target_cycle));
+	jit_subr(JIT_R0, JIT_R0, LIGHTREC_REG_CYCLE);
+	jit_stxi_i(offsetof(struct lightrec_state, profiled_start),
+		   LIGHTREC_REG_STATE, JIT_R0);
+#endif
+
 	start_of_block = jit_label();
 
 	for (elm = block->opcode_list; elm; elm = elm->next) {
 		next_pc = block->pc + elm->offset * sizeof(u32);
 
+		/* Register $zero is always, well, zero */
+		state->known_regs |= BIT(0);
+		state->known_values[0] = 0;
+
+		/* Branches are processed before being emitted, as the delay
+		 * slot will be emitted along with them */
+		if (skip_next || has_delay_slot(elm->c)) {
+			state->known_regs = lightrec_propagate_consts(elm->c,
+					state->known_regs, state->known_values);
+		}
+
 		if (skip_next) {
 			skip_next = false;
 			continue;
@@ -881,6 +1393,11 @@ int lightrec_compile_block(struct block *block)
 			lightrec_regcache_mark_live(state->reg_cache, _jit);
 #endif
 		}
+
+		if (!has_delay_slot(elm->c)) {
+			state->known_regs = lightrec_propagate_consts(elm->c,
+					state->known_regs, state->known_values);
+		}
 	}
 
 	for (i = 0; i < state->nb_branches; i++)
@@ -917,16 +1434,37 @@ int lightrec_compile_block(struct block *block)
 	jit_ret();
 	jit_epilog();
 
+#if ENABLE_COMPILER_STATS
+	lightrec_stats_add(&stages[LIGHTREC_STAGE_EMIT], start);
+	start = lightrec_get_time_ns();
+#endif
+
 	block->function = jit_emit();
 
-	/* Add compiled function to the LUT */
-	state->code_lut[lut_offset(block->pc)] = block->function;
+#if ENABLE_COMPILER_STATS
+	lightrec_stats_add(&stages[LIGHTREC_STAGE_JIT_EMIT], start);
+#endif
+
+	/* Add compiled function to the LUT. Hooked BIOS vectors must always go
+	 * through get_next_block_func(). */
+	if (unlikely(state->bios_hooked) && lightrec_bios_vector(block->pc) >= 0)
+		state->code_lut[lut_offset(block->pc)] = state->get_next_block;
+	else
+		state->code_lut[lut_offset(block->pc)] = block->function;
 
 	jit_get_code(&code_size);
 	lightrec_register(MEM_FOR_CODE, code_size);
 
 	block->code_size = code_size;
 
+#if ENABLE_BLOCK_PROFILER
+	block->compile_time += lightrec_get_time_ns() - compile_start;
+#endif
+
+	/* Not accounted in the compile time, as it does file I/O */
+	if (ENABLE_PERF_MAP && state->perf)
+		lightrec_perf_register_block(state->perf, block);
+
 	if (ENABLE_DISASSEMBLER) {
 		pr_debug("Compiling block at PC: 0x%x\n", block->pc);
 		jit_disassemble();
@@ -948,9 +1486,29 @@ int lightrec_compile_block(struct block *block)
 	return 0;
 }
 
+static u32 lightrec_interpreter_loop(struct lightrec_state *state, u32 pc)
+{
+	struct block *block;
+
+	do {
+		if (unlikely(state->bios_hooked) &&
+		    lightrec_run_bios_hook(state, &pc))
+			continue;
+
+		block = lightrec_get_block(state, pc);
+		if (unlikely(!block))
+			break;
+
+		pc = lightrec_emulate_block(block, pc);
+	} while (state->exit_flags == LIGHTREC_EXIT_NORMAL &&
+		 state->current_cycle < state->target_cycle);
+
+	return pc;
+}
+
 u32 lightrec_execute(struct lightrec_state *state, u32 pc, u32 target_cycle)
 {
-	s32 (*func)(void *, s32) = (void *)state->dispatcher->function;
+	s32 (*func)(void *, s32);
 	void *block_trace;
 	s32 cycles_delta;
 
@@ -962,8 +1520,17 @@ u32 lightrec_execute(struct lightrec_state *state, u32 pc, u32 target_cycle)
 
 	state->target_cycle = target_cycle;
 
+	if (state->builtin_exceptions && lightrec_interrupt_pending(state))
+		pc = lightrec_take_interrupt(state, pc);
+
+	if (state->interpreter_only) {
+		state->next_pc = lightrec_interpreter_loop(state, pc);
+		return state->next_pc;
+	}
+
 	block_trace = get_next_block_func(state, pc);
 	if (block_trace) {
+		func = (void *)state->dispatcher->function;
 		cycles_delta = state->target_cycle - state->current_cycle;
 
 		cycles_delta = (*func)(block_trace, cycles_delta);
@@ -993,27 +1560,39 @@ u32 lightrec_run_interpreter(struct lightrec_state *state, u32 pc)
 void lightrec_free_block(struct block *block)
 {
 	lightrec_unregister(MEM_FOR_MIPS_CODE, block->nb_ops * sizeof(u32));
-	if (block->opcode_list)
+	if (block->opcode_list) {
+		if (block->int_decoded)
+			lightrec_free_predecoded(block);
 		lightrec_free_opcode_list(block->state, block->opcode_list);
+	}
 	if (block->_jit)
 		_jit_destroy_state(block->_jit);
 	lightrec_unregister(MEM_FOR_CODE, block->code_size);
 	lightrec_free(block->state, MEM_FOR_IR, sizeof(*block), block);
 }
 
-struct lightrec_state * lightrec_init(char *argv0,
-				      const struct lightrec_mem_map *map,
-				      size_t nb,
-				      const struct lightrec_ops *ops)
+static struct lightrec_state *
+lightrec_init_state(char *argv0, const struct lightrec_mem_map *map,
+		    size_t nb, const struct lightrec_ops *ops,
+		    bool interpreter_only)
 {
 	struct lightrec_state *state;
+	bool builtin_gte;
 
 	/* Sanity-check ops */
-	if (!ops ||
-	    !ops->cop0_ops.mfc || !ops->cop0_ops.cfc || !ops->cop0_ops.mtc ||
-	    !ops->cop0_ops.ctc || !ops->cop0_ops.op ||
-	    !ops->cop2_ops.mfc || !ops->cop2_ops.cfc || !ops->cop2_ops.mtc ||
-	    !ops->cop2_ops.ctc || !ops->cop2_ops.op) {
+	if (!ops || !ops->cop0_ops.mtc || !ops->cop0_ops.ctc ||
+	    !ops->cop0_ops.op || !ops->cop0_ops.mfc != !ops->cop0_ops.cfc) {
+		pr_err("Missing callbacks in lightrec_ops structure\n");
+		return NULL;
+	}
+
+	builtin_gte = ENABLE_GTE &&
+		!ops->cop2_ops.mfc && !ops->cop2_ops.cfc &&
+		!ops->cop2_ops.mtc && !ops->cop2_ops.ctc && !ops->cop2_ops.op;
+
+	if (!builtin_gte &&
+	    (!ops->cop2_ops.mfc || !ops->cop2_ops.cfc || !ops->cop2_ops.mtc ||
+	     !ops->cop2_ops.ctc || !ops->cop2_ops.op)) {
 		pr_err("Missing callbacks in lightrec_ops structure\n");
 		return NULL;
 	}
@@ -1051,11 +1630,39 @@ struct lightrec_state * lightrec_init(char *argv0,
 	state->nb_maps = nb;
 	state->maps = map;
 
+	if (lightrec_init_map_lut(state))
+		goto err_free_recompiler;
+
 	memcpy(&state->ops, ops, sizeof(*ops));
 
+	if (!ops->cop0_ops.mfc) {
+		pr_info("Mirroring COP0 registers\n");
+		state->cop0_host_ops = ops->cop0_ops;
+		state->ops.cop0_ops = lightrec_cop0_mirror_ops;
+		state->ops.cop0_ops.op = ops->cop0_ops.op;
+		state->mirror_cop0 = true;
+	}
+
+	if (ENABLE_GTE && builtin_gte) {
+		pr_info("Using built-in GTE\n");
+		lightrec_gte_init();
+		state->ops.cop2_ops = lightrec_gte_ops;
+		state->builtin_gte = true;
+	}
+
+	if (interpreter_only) {
+		pr_info("Running in interpreter-only mode\n");
+		state->interpreter_only = true;
+
+		/* Only used as a non-NULL marker in the code LUT */
+		state->get_next_block =
+			(void (*)(void)) lightrec_interpreter_loop;
+		goto skip_wrappers;
+	}
+
 	state->dispatcher = generate_dispatcher(state);
 	if (!state->dispatcher)
-		goto err_free_recompiler;
+		goto err_free_map_targets;
 
 	state->rw_generic_wrapper = generate_wrapper(state,
 						     lightrec_rw_generic_cb,
@@ -1063,30 +1670,14 @@ struct lightrec_state * lightrec_init(char *argv0,
 	if (!state->rw_generic_wrapper)
 		goto err_free_dispatcher;
 
-	state->rw_wrapper = generate_wrapper(state, lightrec_rw_cb, false);
-	if (!state->rw_wrapper)
-		goto err_free_generic_rw_wrapper;
-
-	state->mfc_wrapper = generate_wrapper(state, lightrec_mfc_cb, false);
-	if (!state->mfc_wrapper)
-		goto err_free_rw_wrapper;
-
-	state->mtc_wrapper = generate_wrapper(state, lightrec_mtc_cb, false);
-	if (!state->mtc_wrapper)
-		goto err_free_mfc_wrapper;
-
 	state->rfe_wrapper = generate_wrapper(state, lightrec_rfe_cb, false);
 	if (!state->rfe_wrapper)
-		goto err_free_mtc_wrapper;
-
-	state->cp_wrapper = generate_wrapper(state, lightrec_cp_cb, false);
-	if (!state->cp_wrapper)
-		goto err_free_rfe_wrapper;
+		goto err_free_generic_rw_wrapper;
 
 	state->syscall_wrapper = generate_wrapper(state, lightrec_syscall_cb,
 						  false);
 	if (!state->syscall_wrapper)
-		goto err_free_cp_wrapper;
+		goto err_free_rfe_wrapper;
 
 	state->break_wrapper = generate_wrapper(state, lightrec_break_cb,
 						false);
@@ -1094,14 +1685,11 @@ struct lightrec_state * lightrec_init(char *argv0,
 		goto err_free_syscall_wrapper;
 
 	state->rw_generic_func = state->rw_generic_wrapper->function;
-	state->rw_func = state->rw_wrapper->function;
-	state->mfc_func = state->mfc_wrapper->function;
-	state->mtc_func = state->mtc_wrapper->function;
 	state->rfe_func = state->rfe_wrapper->function;
-	state->cp_func = state->cp_wrapper->function;
 	state->syscall_func = state->syscall_wrapper->function;
 	state->break_func = state->break_wrapper->function;
 
+skip_wrappers:
 	map = &state->maps[PSX_MAP_BIOS];
 	state->offset_bios = (uintptr_t)map->address - map->pc;
 
@@ -1116,24 +1704,27 @@ struct lightrec_state * lightrec_init(char *argv0,
 	    state->maps[PSX_MAP_MIRROR3].address == map->address + 0x600000)
 		state->mirrors_mapped = true;
 
+	/* Host address of $sp == 0, see rec_sp_address() */
+	state->sp_tag = 0;
+	state->sp_host = state->offset_ram;
+
+	/* Not fatal - stores will invalidate code by software otherwise */
+	if (ENABLE_PAGE_PROTECTION)
+		state->pageprot = lightrec_pageprot_init(state);
+
 	return state;
 
 err_free_syscall_wrapper:
 	lightrec_free_block(state->syscall_wrapper);
-err_free_cp_wrapper:
-	lightrec_free_block(state->cp_wrapper);
 err_free_rfe_wrapper:
 	lightrec_free_block(state->rfe_wrapper);
-err_free_mtc_wrapper:
-	lightrec_free_block(state->mtc_wrapper);
-err_free_mfc_wrapper:
-	lightrec_free_block(state->mfc_wrapper);
-err_free_rw_wrapper:
-	lightrec_free_block(state->rw_wrapper);
 err_free_generic_rw_wrapper:
 	lightrec_free_block(state->rw_generic_wrapper);
 err_free_dispatcher:
 	lightrec_free_block(state->dispatcher);
+err_free_map_targets:
+	lightrec_free(state, MEM_FOR_LIGHTREC,
+		      sizeof(*state->map_targets) * nb, state->map_targets);
 err_free_recompiler:
 	if (ENABLE_THREADED_COMPILER)
 		lightrec_free_recompiler(state->rec);
@@ -1154,22 +1745,45 @@ err_finish_jit:
 	return NULL;
 }
 
+struct lightrec_state * lightrec_init(char *argv0,
+				      const struct lightrec_mem_map *map,
+				      size_t nb,
+				      const struct lightrec_ops *ops)
+{
+	return lightrec_init_state(argv0, map, nb, ops, false);
+}
+
+struct lightrec_state *
+lightrec_init_interpreter(char *argv0, const struct lightrec_mem_map *map,
+			  size_t nb, const struct lightrec_ops *ops)
+{
+	return lightrec_init_state(argv0, map, nb, ops, true);
+}
+
 void lightrec_destroy(struct lightrec_state *state)
 {
 	if (ENABLE_THREADED_COMPILER)
 		lightrec_free_recompiler(state->rec);
 
+	if (ENABLE_PAGE_PROTECTION && state->pageprot)
+		lightrec_free_pageprot(state->pageprot);
+
+	if (ENABLE_PERF_MAP && state->perf)
+		lightrec_free_perf(state->perf);
+
 	lightrec_free_regcache(state->reg_cache);
 	lightrec_free_block_cache(state->block_cache);
-	lightrec_free_block(state->dispatcher);
-	lightrec_free_block(state->rw_generic_wrapper);
-	lightrec_free_block(state->rw_wrapper);
-	lightrec_free_block(state->mfc_wrapper);
-	lightrec_free_block(state->mtc_wrapper);
-	lightrec_free_block(state->rfe_wrapper);
-	lightrec_free_block(state->cp_wrapper);
-	lightrec_free_block(state->syscall_wrapper);
-	lightrec_free_block(state->break_wrapper);
+
+	if (!state->interpreter_only) {
+		lightrec_free_block(state->dispatcher);
+		lightrec_free_block(state->rw_generic_wrapper);
+		lightrec_free_block(state->rfe_wrapper);
+		lightrec_free_block(state->syscall_wrapper);
+		lightrec_free_block(state->break_wrapper);
+	}
+
+	lightrec_free(state, MEM_FOR_LIGHTREC, sizeof(*state->map_targets) *
+		      state->nb_maps, state->map_targets);
 	finish_jit();
 
 #if ENABLE_TINYMM
@@ -1186,8 +1800,7 @@ void lightrec_invalidate(struct lightrec_state *state, u32 addr, u32 len)
 	const struct lightrec_mem_map *map = lightrec_get_map(state, kaddr);
 
 	if (map) {
-		while (map->mirror_of)
-			map = map->mirror_of;
+		map = lightrec_map_target(state, map);
 
 		if (map != &state->maps[PSX_MAP_KERNEL_USER_RAM])
 			return;
@@ -1215,6 +1828,54 @@ void lightrec_set_invalidate_mode(struct lightrec_state *state, bool dma_only)
 	state->invalidate_from_dma_only = dma_only;
 }
 
+int lightrec_register_io_handler(struct lightrec_state *state,
+				 u32 addr, u32 length,
+				 const struct lightrec_mem_map_ops *ops)
+{
+	struct lightrec_io_handler *handler;
+
+	if (!ops || !length)
+		return -EINVAL;
+
+	if (state->nb_io_handlers == ARRAY_SIZE(state->io_handlers))
+		return -ENOSPC;
+
+	handler = &state->io_handlers[state->nb_io_handlers++];
+	handler->addr = kunseg(addr);
+	handler->length = length;
+	handler->ops = ops;
+
+	/* Recompile everything so that the new handler gets used */
+	lightrec_invalidate_all(state);
+
+	return 0;
+}
+
+int lightrec_register_bios_hook(struct lightrec_state *state,
+				u32 vector, u32 func, lightrec_bios_hook_t hook)
+{
+	int idx = lightrec_bios_vector(vector);
+	unsigned int i;
+
+	if (idx < 0 || func >= NB_BIOS_FUNCS)
+		return -EINVAL;
+
+	state->bios_hooks[idx][func] = hook;
+
+	state->bios_hooked &= ~BIT(idx);
+	for (i = 0; i < NB_BIOS_FUNCS; i++) {
+		if (state->bios_hooks[idx][i]) {
+			state->bios_hooked |= BIT(idx);
+			break;
+		}
+	}
+
+	/* Make sure the dispatcher doesn't jump straight to the vector */
+	lightrec_invalidate_all(state);
+
+	return 0;
+}
+
 void lightrec_set_exit_flags(struct lightrec_state *state, u32 flags)
 {
 	if (flags != LIGHTREC_EXIT_NORMAL) {
@@ -1238,6 +1899,274 @@ void lightrec_restore_registers(struct lightrec_state *state, u32 regs[34])
 	memcpy(state->native_reg_cache, regs, sizeof(state->native_reg_cache));
 }
 
+u32 lightrec_get_cop0_reg(struct lightrec_state *state, u8 reg)
+{
+	return state->cop0_regs[reg & 31];
+}
+
+void lightrec_set_cop0_reg(struct lightrec_state *state, u8 reg, u32 value)
+{
+	state->cop0_regs[reg & 31] = value;
+}
+
+int lightrec_set_builtin_exceptions(struct lightrec_state *state, bool enable)
+{
+	if (enable && !state->mirror_cop0)
+		return -EINVAL;
+
+	if (state->builtin_exceptions != enable) {
+		state->builtin_exceptions = enable;
+
+		/* SYSCALL and BREAK opcodes must be recompiled */
+		lightrec_invalidate_all(state);
+	}
+
+	return 0;
+}
+
+int lightrec_precompile_range(struct lightrec_state *state,
+			      u32 entry, u32 addr, u32 len)
+{
+	u32 stack[PRECOMPILE_STACK_SIZE], pc;
+	unsigned int nb = 0, nb_blocks = 0;
+	struct block *block;
+
+	if (!len || kunseg(addr) + len < kunseg(addr))
+		return -EINVAL;
+
+	stack[nb++] = entry;
+
+	while (nb) {
+		pc = stack[--nb];
+
+		/* Don't follow the code out of the given range */
+		if (kunseg(pc) - kunseg(addr) >= len || (pc & 0x3))
+			continue;
+
+		block = lightrec_speculate_block(state, pc);
+		if (!block)
+			continue;
+
+		nb_blocks++;
+
+		nb += lightrec_get_successors(block, &stack[nb],
+					      ARRAY_SIZE(stack) - nb);
+
+		/* The compilation may free the opcode list, so it must happen
+		 * after the successors have been gathered */
+		lightrec_speculate_compile(state, block);
+	}
+
+	pr_debug("Precompiled %u blocks from PC 0x%08x\n", nb_blocks, entry);
+
+	return nb_blocks;
+}
+
+int lightrec_set_speculative_compile(struct lightrec_state *state, bool enable)
+{
+	if (enable && (!ENABLE_THREADED_COMPILER || state->interpreter_only))
+		return -EINVAL;
+
+	state->speculative_compile = enable;
+
+	return 0;
+}
+
+int lightrec_set_perf_output(struct lightrec_state *state, u32 flags)
+{
+	const struct {
+		const struct block *block;
+		const char *name;
+	} wrappers[] = {
+		{ state->dispatcher, "lightrec_dispatcher" },
+		{ state->rw_generic_wrapper, "lightrec_rw_wrapper" },
+		{ state->rfe_wrapper, "lightrec_rfe_wrapper" },
+		{ state->syscall_wrapper, "lightrec_syscall_wrapper" },
+		{ state->break_wrapper, "lightrec_break_wrapper" },
+	};
+	struct lightrec_perf *perf = NULL, *old;
+	unsigned int i;
+
+	if (!ENABLE_PERF_MAP)
+		return -EINVAL;
+
+	if (flags) {
+		perf = lightrec_perf_init(state, flags);
+		if (!perf)
+			return -EIO;
+
+		/* The dispatcher and wrappers were generated by
+		 * lightrec_init() */
+		for (i = 0; !state->interpreter_only &&
+		     i < ARRAY_SIZE(wrappers); i++) {
+			lightrec_perf_register(perf,
+					       wrappers[i].block->function,
+					       wrappers[i].block->code_size,
+					       wrappers[i].name);
+		}
+	}
+
+	/* The recompiler thread may be registering a block with the old
+	 * output - wait for it before freeing it */
+	if (ENABLE_THREADED_COMPILER)
+		lightrec_recompiler_pause(state->rec);
+
+	old = state->perf;
+	state->perf = perf;
+
+	if (ENABLE_THREADED_COMPILER)
+		lightrec_recompiler_unpause(state->rec);
+
+	if (old)
+		lightrec_free_perf(old);
+
+	return 0;
+}
+
+#if ENABLE_BLOCK_PROFILER
+struct lightrec_block_stats_list {
+	struct lightrec_block_stats *stats;
+	unsigned int nb, max;
+};
+
+static void lightrec_add_block_stats(struct block *block, void *d)
+{
+	struct lightrec_block_stats_list *list = d;
+	struct lightrec_block_stats *stats = list->stats;
+	unsigned int i;
+
+	if (!block->function || !list->max)
+		return;
+
+	/* Keep the list sorted by decreasing number of cycles */
+	for (i = list->nb; i > 0 && stats[i - 1].cycles < block->cycles; i--) {
+		if (i < list->max)
+			stats[i] = stats[i - 1];
+	}
+
+	if (i == list->max)
+		return;
+
+	stats[i] = (struct lightrec_block_stats) {
+		.pc = block->pc,
+		.length = block->nb_ops * sizeof(u32),
+		.code_size = block->code_size,
+		.flags = block->flags,
+		.exec_count = block->exec_count,
+		.cycles = block->cycles,
+		.compile_time = block->compile_time,
+	};
+
+	if (list->nb < list->max)
+		list->nb++;
+}
+
+static void lightrec_clear_block_stats(struct block *block, void *d)
+{
+	block->exec_count = 0;
+	block->cycles = 0;
+}
+#endif
+
+int lightrec_get_block_stats(struct lightrec_state *state,
+			     struct lightrec_block_stats *stats,
+			     unsigned int nb)
+{
+#if ENABLE_BLOCK_PROFILER
+	struct lightrec_block_stats_list list = {
+		.stats = stats,
+		.max = nb,
+	};
+
+	lightrec_blockcache_foreach(state->block_cache,
+				    lightrec_add_block_stats, &list);
+
+	return list.nb;
+#else
+	return -EINVAL;
+#endif
+}
+
+void lightrec_reset_block_stats(struct lightrec_state *state)
+{
+#if ENABLE_BLOCK_PROFILER
+	lightrec_blockcache_foreach(state->block_cache,
+				    lightrec_clear_block_stats, NULL);
+#endif
+}
+
+int lightrec_get_compiler_stats(struct lightrec_state *state,
+				struct lightrec_compiler_stats *stats)
+{
+#if ENABLE_COMPILER_STATS
+	static const char * const stage_names[] = {
+		[LIGHTREC_STAGE_DISASSEMBLE] = "disassemble",
+		[LIGHTREC_STAGE_OPTIMIZE] = "optimize",
+		[LIGHTREC_STAGE_EMIT] = "emit",
+		[LIGHTREC_STAGE_JIT_EMIT] = "jit_emit",
+		[LIGHTREC_STAGE_QUEUE_WAIT] = "queue_wait",
+	};
+	const char *name;
+	unsigned int i;
+
+	*stats = state->compiler_stats;
+
+	if (ENABLE_THREADED_COMPILER)
+		lightrec_recompiler_get_stats(state->rec, stats);
+
+	for (i = 0; i < LIGHTREC_STAGE_COUNT; i++)
+		stats->stages[i].name = stage_names[i];
+
+	for (i = 0; i < LIGHTREC_STATS_MAX_PASSES; i++) {
+		name = lightrec_optimizer_name(i);
+		if (!name)
+			break;
+
+		stats->passes[i].name = name;
+	}
+
+	stats->nb_passes = i;
+
+	return 0;
+#else
+	return -EINVAL;
+#endif
+}
+
+void lightrec_reset_compiler_stats(struct lightrec_state *state)
+{
+#if ENABLE_COMPILER_STATS
+	/* Blocks compiled meanwhile by the recompiler thread may be partly
+	 * accounted for */
+	memset(&state->compiler_stats, 0, sizeof(state->compiler_stats));
+
+	if (ENABLE_THREADED_COMPILER)
+		lightrec_recompiler_reset_stats(state->rec);
+#endif
+}
+
+void lightrec_raise_interrupt(struct lightrec_state *state, u32 cause_bits)
+{
+	state->cop0_regs[13] |= cause_bits & 0xff00;
+
+	if (lightrec_interrupt_pending(state))
+		lightrec_set_exit_flags(state, LIGHTREC_EXIT_CHECK_INTERRUPT);
+}
+
+void lightrec_dump_gte_registers(struct lightrec_state *state,
+				 u32 data[32], u32 ctrl[32])
+{
+	memcpy(data, state->gte.data, sizeof(state->gte.data));
+	memcpy(ctrl, state->gte.ctrl, sizeof(state->gte.ctrl));
+}
+
+void lightrec_restore_gte_registers(struct lightrec_state *state,
+				    const u32 data[32], const u32 ctrl[32])
+{
+	memcpy(state->gte.data, data, sizeof(state->gte.data));
+	memcpy(state->gte.ctrl, ctrl, sizeof(state->gte.ctrl));
+}
+
 u32 lightrec_current_cycle_count(const struct lightrec_state *state)
 {
 	return state->current_cycle;
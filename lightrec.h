@@ -56,6 +56,10 @@ struct lightrec_mem_map;
 #define LIGHTREC_EXIT_CHECK_INTERRUPT	(1 << 2)
 #define LIGHTREC_EXIT_SEGFAULT	(1 << 3)
 
+/* Flags for lightrec_set_perf_output() */
+#define LIGHTREC_PERF_MAP	(1 << 0)
+#define LIGHTREC_PERF_JITDUMP	(1 << 1)
+
 enum psx_map {
 	PSX_MAP_KERNEL_USER_RAM,
 	PSX_MAP_BIOS,
@@ -76,6 +80,11 @@ enum mem_type {
 	MEM_TYPE_END,
 };
 
+struct lightrec_io_write {
+	u32 addr;
+	u32 data;
+};
+
 struct lightrec_mem_map_ops {
 	void (*sb)(struct lightrec_state *, u32 addr, u8 data);
 	void (*sh)(struct lightrec_state *, u32 addr, u16 data);
@@ -83,6 +92,11 @@ struct lightrec_mem_map_ops {
 	u8 (*lb)(struct lightrec_state *, u32 addr);
 	u16 (*lh)(struct lightrec_state *, u32 addr);
 	u32 (*lw)(struct lightrec_state *, u32 addr);
+
+	/* Optional. Performs a sequence of 32-bit writes, in order. */
+	void (*sw_batch)(struct lightrec_state *,
+			 const struct lightrec_io_write *writes,
+			 unsigned int count);
 };
 
 struct lightrec_mem_map {
@@ -106,11 +120,24 @@ struct lightrec_ops {
 	struct lightrec_cop_ops cop2_ops;
 };
 
+/* If the library was built with the built-in GTE, all the cop2_ops callbacks
+ * can be left NULL to use it.
+ * If the mfc and cfc callbacks of cop0_ops are NULL, lightrec keeps the COP0
+ * registers itself, and only calls the mtc and ctc callbacks for writes that
+ * have side effects (to SR, Cause and the debug registers). The frontend then
+ * accesses the COP0 registers with lightrec_{get,set}_cop0_reg(). */
 __api struct lightrec_state *lightrec_init(char *argv0,
 					   const struct lightrec_mem_map *map,
 					   size_t nb,
 					   const struct lightrec_ops *ops);
 
+/* Same as lightrec_init(), but the returned instance only ever uses the
+ * interpreter, and never generates code at runtime. Useful on hosts that
+ * cannot map executable memory. */
+__api struct lightrec_state *
+lightrec_init_interpreter(char *argv0, const struct lightrec_mem_map *map,
+			  size_t nb, const struct lightrec_ops *ops);
+
 __api void lightrec_destroy(struct lightrec_state *state);
 
 __api u32 lightrec_execute(struct lightrec_state *state,
@@ -123,6 +150,27 @@ __api void lightrec_invalidate_all(struct lightrec_state *state);
 __api void lightrec_set_invalidate_mode(struct lightrec_state *state,
 					_Bool dma_only);
 
+/* Register handlers for a range of I/O addresses (KUNSEG). When the address of
+ * a load or store is known at compile time and falls in this range, the
+ * handler will be called directly from the recompiled code. The handlers must
+ * behave the same as the ones of the memory map covering this range. */
+__api int lightrec_register_io_handler(struct lightrec_state *state,
+				       u32 addr, u32 length,
+				       const struct lightrec_mem_map_ops *ops);
+
+/* Native handler for a BIOS function. The guest registers are passed with
+ * the same layout as lightrec_dump_registers(), and can be modified. Returns
+ * the number of cycles spent, or a negative value to run the BIOS code
+ * instead. Execution resumes at the address in $ra. */
+typedef s32 (*lightrec_bios_hook_t)(struct lightrec_state *state,
+				    u32 regs[34]);
+
+/* Register a handler for the function number 'func' (passed in $t1) of the
+ * BIOS vector 0xa0, 0xb0 or 0xc0. A NULL handler removes the hook. */
+__api int lightrec_register_bios_hook(struct lightrec_state *state,
+				      u32 vector, u32 func,
+				      lightrec_bios_hook_t hook);
+
 __api void lightrec_set_exit_flags(struct lightrec_state *state, u32 flags);
 __api u32 lightrec_exit_flags(struct lightrec_state *state);
 
@@ -130,11 +178,121 @@ __api void lightrec_dump_registers(struct lightrec_state *state, u32 regs[34]);
 __api void lightrec_restore_registers(struct lightrec_state *state,
 				      u32 regs[34]);
 
+/* Access the mirrored COP0 registers; 'reg' is taken modulo 32 */
+__api u32 lightrec_get_cop0_reg(struct lightrec_state *state, u8 reg);
+__api void lightrec_set_cop0_reg(struct lightrec_state *state,
+				 u8 reg, u32 value);
+
+/* Handle exceptions without returning to the frontend. Requires the COP0
+ * registers to be mirrored (see lightrec_init()). SYSCALL and BREAK then jump
+ * to the exception vector, and pending interrupts are taken when
+ * lightrec_execute() is called. Returns -EINVAL if COP0 is not mirrored. */
+__api int lightrec_set_builtin_exceptions(struct lightrec_state *state,
+					  _Bool enable);
+
+/* Disassemble and compile the code reachable from the entry point 'entry',
+ * without leaving the range [addr, addr + len). With the threaded
+ * recompiler, the blocks are compiled in the background while it is idle.
+ * Blocks with I/O accesses of unknown type are only compiled after their first
+ * run. Useful to warm up after loading an executable. Returns the number of
+ * new blocks, or a negative error code. */
+__api int lightrec_precompile_range(struct lightrec_state *state,
+				    u32 entry, u32 addr, u32 len);
+
+/* With the threaded recompiler, also compile the blocks that can be reached
+ * from each new block, while the recompiler thread is otherwise idle.
+ * Returns -EINVAL if the threaded recompiler is not available. */
+__api int lightrec_set_speculative_compile(struct lightrec_state *state,
+					   _Bool enable);
+
+/* Describe the generated code to the Linux 'perf' tool, with a
+ * /tmp/perf-<pid>.map file (LIGHTREC_PERF_MAP) and/or a /tmp/jit-<pid>.dump
+ * file for 'perf inject --jit' (LIGHTREC_PERF_JITDUMP). Blocks are named
+ * after their MIPS address, e.g. blk_80012345. Blocks compiled before the
+ * call are not described. A zero 'flags' closes the files.
+ * Returns -EINVAL if the library was built without ENABLE_PERF_MAP. */
+__api int lightrec_set_perf_output(struct lightrec_state *state, u32 flags);
+
+/* Set interrupt pending bits (8-15) in the mirrored Cause register. If the
+ * interrupt is enabled, lightrec_execute() returns as soon as possible with
+ * LIGHTREC_EXIT_CHECK_INTERRUPT. */
+__api void lightrec_raise_interrupt(struct lightrec_state *state,
+				    u32 cause_bits);
+
+/* Access to the data and control registers of the built-in GTE */
+__api void lightrec_dump_gte_registers(struct lightrec_state *state,
+				       u32 data[32], u32 ctrl[32]);
+__api void lightrec_restore_gte_registers(struct lightrec_state *state,
+					  const u32 data[32],
+					  const u32 ctrl[32]);
+
 __api u32 lightrec_current_cycle_count(const struct lightrec_state *state);
 __api void lightrec_reset_cycle_count(struct lightrec_state *state, u32 cycles);
 __api void lightrec_set_target_cycle_count(struct lightrec_state *state,
 					   u32 cycles);
 
+struct lightrec_block_stats {
+	u32 pc;
+	u32 length;		/* Size of the MIPS code, in bytes */
+	u32 code_size;		/* Size of the native code, in bytes */
+	u32 flags;
+	u64 exec_count;
+	u64 cycles;
+	u64 compile_time;	/* In nanoseconds */
+};
+
+/* Only available if the library was built with ENABLE_BLOCK_PROFILER.
+ * Fills 'stats' with the (up to) 'nb' compiled blocks that consumed the most
+ * cycles, sorted by decreasing cost. Returns the number of entries filled,
+ * or -EINVAL if the profiler is not available. */
+__api int lightrec_get_block_stats(struct lightrec_state *state,
+				   struct lightrec_block_stats *stats,
+				   unsigned int nb);
+__api void lightrec_reset_block_stats(struct lightrec_state *state);
+
+enum lightrec_compile_stage {
+	LIGHTREC_STAGE_DISASSEMBLE,
+	LIGHTREC_STAGE_OPTIMIZE,	/* All the optimizer passes */
+	LIGHTREC_STAGE_EMIT,		/* Lightning code generation */
+	LIGHTREC_STAGE_JIT_EMIT,	/* jit_emit() */
+	LIGHTREC_STAGE_QUEUE_WAIT,	/* From enqueue to compiled */
+	LIGHTREC_STAGE_COUNT,
+};
+
+#define LIGHTREC_STATS_HIST_SIZE	16
+#define LIGHTREC_STATS_MAX_PASSES	32
+
+struct lightrec_stage_stats {
+	const char *name;
+	u64 count;
+	u64 total_ns;
+	u64 max_ns;
+	/* Bucket 0 counts the values under 1 (microsecond, or queued block),
+	 * bucket N the ones in [2^(N-1), 2^N), and the last bucket also
+	 * counts everything above */
+	u32 histogram[LIGHTREC_STATS_HIST_SIZE];
+};
+
+struct lightrec_compiler_stats {
+	struct lightrec_stage_stats stages[LIGHTREC_STAGE_COUNT];
+	struct lightrec_stage_stats passes[LIGHTREC_STATS_MAX_PASSES];
+	unsigned int nb_passes;
+
+	/* Threaded recompiler only */
+	u32 queue_depth;
+	u32 max_queue_depth;
+	u32 queue_histogram[LIGHTREC_STATS_HIST_SIZE]; /* Depth at enqueue */
+	u64 nb_interpreted; /* Blocks interpreted while waiting */
+};
+
+/* Only available if the library was built with ENABLE_COMPILER_STATS.
+ * Returns the time spent in each compilation stage and optimizer pass, and
+ * the state of the threaded recompiler's queue. Returns -EINVAL if the
+ * statistics are not available. */
+__api int lightrec_get_compiler_stats(struct lightrec_state *state,
+				      struct lightrec_compiler_stats *stats);
+__api void lightrec_reset_compiler_stats(struct lightrec_state *state);
+
 __api unsigned int lightrec_get_mem_usage(enum mem_type type);
 __api unsigned int lightrec_get_total_mem_usage(void);
 __api float lightrec_get_average_ipi(void);
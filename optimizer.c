@@ -102,6 +102,9 @@ bool opcode_writes_register(union code op, u8 reg)
 			return false;
 		case OP_SPECIAL_MULT:
 		case OP_SPECIAL_MULTU:
+			/* rd is set when a MFLO has been merged */
+			return reg == REG_LO || reg == REG_HI ||
+				(op.r.rd && op.r.rd == reg);
 		case OP_SPECIAL_DIV:
 		case OP_SPECIAL_DIVU:
 			return reg == REG_LO || reg == REG_HI;
@@ -256,7 +259,7 @@ bool load_in_delay_slot(union code op)
 	return false;
 }
 
-static u32 lightrec_propagate_consts(union code c, u32 known, u32 *v)
+u32 lightrec_propagate_consts(union code c, u32 known, u32 *v)
 {
 	switch (c.i.op) {
 	case OP_SPECIAL:
@@ -377,10 +380,21 @@ static u32 lightrec_propagate_consts(union code c, u32 known, u32 *v)
 			}
 			break;
 		default:
+			/* MFHI, MFLO, JALR */
+			known &= ~BIT(c.r.rd);
 			break;
 		}
 		break;
 	case OP_REGIMM:
+		switch (c.r.rt) {
+		case OP_REGIMM_BLTZAL:
+		case OP_REGIMM_BGEZAL:
+			known &= ~BIT(31);
+			break;
+		}
+		break;
+	case OP_JAL:
+		known &= ~BIT(31);
 		break;
 	case OP_ADDI:
 	case OP_ADDIU:
@@ -471,6 +485,10 @@ static u32 lightrec_propagate_consts(union code c, u32 known, u32 *v)
 			known &= ~BIT(c.r.rd);
 		}
 		break;
+	case OP_META_SYNC:
+		/* Branch target - the values of the registers are unknown */
+		known = 0;
+		break;
 	default:
 		break;
 	}
@@ -617,6 +635,11 @@ static int lightrec_switch_delay_slots(struct block *block)
 		if (prev && has_delay_slot(prev->c))
 			continue;
 
+		/* The exception must be raised from the delay slot, so that
+		 * EPC and Cause.BD point to the branch */
+		if (is_syscall_or_break(next_op))
+			continue;
+
 		switch (list->i.op) {
 		case OP_SPECIAL:
 			switch (op.r.op) {
@@ -780,6 +803,12 @@ static int lightrec_local_branches(struct block *block)
 	return 0;
 }
 
+bool is_syscall_or_break(union code op)
+{
+	return op.i.op == OP_SPECIAL && (op.r.op == OP_SPECIAL_SYSCALL ||
+					 op.r.op == OP_SPECIAL_BREAK);
+}
+
 bool has_delay_slot(union code op)
 {
 	switch (op.i.op) {
@@ -877,6 +906,8 @@ static int lightrec_flag_stores(struct block *block)
 		case OP_SB:
 		case OP_SH:
 		case OP_SW:
+		case OP_SWL:
+		case OP_SWR:
 			/* Mark all store operations that target $sp, $gp, $k0
 			 * or $k1 as not requiring code invalidation. This is
 			 * based on the heuristic that stores using one of these
@@ -908,12 +939,84 @@ static int lightrec_flag_stores(struct block *block)
 	return 0;
 }
 
-static bool is_mult32(const struct block *block, const struct opcode *op)
+static int lightrec_flag_const_io(struct block *block)
+{
+	const struct lightrec_mem_map *map;
+	struct opcode *list;
+	u32 known = BIT(0);
+	u32 values[32] = { 0 };
+
+	for (list = block->opcode_list; list; list = list->next) {
+		/* Register $zero is always, well, zero */
+		known |= BIT(0);
+		values[0] = 0;
+
+		switch (list->i.op) {
+		case OP_LB:
+		case OP_LH:
+		case OP_LWL:
+		case OP_LW:
+		case OP_LBU:
+		case OP_LHU:
+		case OP_LWR:
+		case OP_LWC2:
+		case OP_SB:
+		case OP_SH:
+		case OP_SWL:
+		case OP_SW:
+		case OP_SWR:
+		case OP_SWC2:
+			/* Tag the loads/stores whose address is known at
+			 * compile time, the same way the first pass would */
+			if (!(known & BIT(list->i.rs)))
+				break;
+
+			map = lightrec_get_map(block->state,
+					       kunseg(values[list->i.rs] +
+						      (s16)list->i.imm));
+			if (!map)
+				break;
+
+			pr_debug("Tagging opcode 0x%08x as %s I/O\n",
+				 list->opcode, map->ops ? "HW" : "direct");
+
+			if (map->ops)
+				list->flags |= LIGHTREC_HW_IO;
+			else
+				list->flags |= LIGHTREC_DIRECT_IO;
+		default: /* fall-through */
+			break;
+		}
+
+		known = lightrec_propagate_consts(list->c, known, values);
+	}
+
+	return 0;
+}
+
+#define HILO_MAX_TARGETS 32
+
+struct hilo_visited {
+	u16 offsets[HILO_MAX_TARGETS];
+	unsigned int nb;
+};
+
+/* Returns true if the HI or LO register (reg) is always written before being
+ * read, on every path starting at the given opcode. */
+static bool is_hilo_dead(const struct block *block, const struct opcode *op,
+			 u8 reg, struct hilo_visited *visited)
 {
-	const struct opcode *next, *last = NULL;
-	u32 offset;
+	const struct opcode *target;
+	unsigned int i;
+	s32 offset;
+
+	for (; op; op = op->next) {
+		if (opcode_reads_register(op->c, reg))
+			return false;
+
+		if (opcode_writes_register(op->c, reg))
+			return true;
 
-	for (op = op->next; op != last; op = op->next) {
 		switch (op->i.op) {
 		case OP_BEQ:
 		case OP_BNE:
@@ -922,52 +1025,77 @@ static bool is_mult32(const struct block *block, const struct opcode *op)
 		case OP_REGIMM:
 		case OP_META_BEQZ:
 		case OP_META_BNEZ:
-			/* TODO: handle backwards branches too */
-			if ((op->flags & LIGHTREC_LOCAL_BRANCH) &&
-			    (s16)op->c.i.imm >= 0) {
-				offset = op->offset + 1 + (s16)op->c.i.imm;
-
-				for (next = op; next->offset != offset;
-				     next = next->next);
+			if (!(op->flags & LIGHTREC_LOCAL_BRANCH))
+				return false;
 
-				if (!is_mult32(block, next))
+			/* The delay slot is executed on both paths */
+			if (!(op->flags & LIGHTREC_NO_DS)) {
+				if (opcode_reads_register(op->next->c, reg))
 					return false;
 
-				last = next;
+				if (opcode_writes_register(op->next->c, reg))
+					return true;
+			}
+
+			offset = op->offset + 1 + (s16)op->i.imm;
+
+			/* Each branch target is only explored once, which also
+			 * terminates the walk on backward branches */
+			for (i = 0; i < visited->nb; i++)
+				if (visited->offsets[i] == offset)
+					break;
+
+			if (i < visited->nb)
 				continue;
-			} else {
+
+			if (visited->nb == HILO_MAX_TARGETS)
 				return false;
-			}
+
+			visited->offsets[visited->nb++] = offset;
+
+			for (target = block->opcode_list;
+			     target->offset != offset; target = target->next);
+
+			if (!is_hilo_dead(block, target, reg, visited))
+				return false;
+
+			continue;
 		case OP_SPECIAL:
 			switch (op->r.op) {
-			case OP_SPECIAL_MULT:
-			case OP_SPECIAL_MULTU:
-			case OP_SPECIAL_DIV:
-			case OP_SPECIAL_DIVU:
-			case OP_SPECIAL_MTHI:
-				return true;
 			case OP_SPECIAL_JR:
+				/* HI/LO are not preserved across function
+				 * returns */
 				return op->r.rs == 31 &&
 					((op->flags & LIGHTREC_NO_DS) ||
-					 !(op->next->i.op == OP_SPECIAL &&
-					   op->next->r.op == OP_SPECIAL_MFHI));
+					 !opcode_reads_register(op->next->c, reg));
 			case OP_SPECIAL_JALR:
-			case OP_SPECIAL_MFHI:
 				return false;
 			default:
 				continue;
 			}
+		case OP_J:
+		case OP_JAL:
+			return false;
 		default:
 			continue;
 		}
 	}
 
-	return last != NULL;
+	return false;
+}
+
+static bool hilo_reg_is_dead(const struct block *block,
+			     const struct opcode *op, u8 reg)
+{
+	struct hilo_visited visited = { .nb = 0 };
+
+	return is_hilo_dead(block, op->next, reg, &visited);
 }
 
 static int lightrec_flag_mults(struct block *block)
 {
-	struct opcode *list, *prev;
+	struct opcode *list, *prev, *next;
+	bool is_mult;
 
 	for (list = block->opcode_list, prev = NULL; list;
 	     prev = list, list = list->next) {
@@ -977,41 +1105,589 @@ static int lightrec_flag_mults(struct block *block)
 		switch (list->r.op) {
 		case OP_SPECIAL_MULT:
 		case OP_SPECIAL_MULTU:
+			is_mult = true;
+			break;
+		case OP_SPECIAL_DIV:
+		case OP_SPECIAL_DIVU:
+			is_mult = false;
 			break;
 		default:
 			continue;
 		}
 
-		/* Don't support MULT(U) opcodes in delay slots */
+		/* The rd field is unused by these opcodes; it holds the target
+		 * register of a merged MFLO */
+		list->r.rd = 0;
+
+		/* Don't support MULT/DIV opcodes in delay slots */
 		if (prev && has_delay_slot(prev->c))
 			continue;
 
-		if (is_mult32(block, list)) {
-			pr_debug("Mark MULT(U) opcode at offset 0x%x as"
-				 " 32-bit\n", list->offset << 2);
-			list->flags |= LIGHTREC_MULT32;
+		/* MULT(U) followed by MFLO: the MFLO is merged into the MULT,
+		 * which then writes the low word directly to rd. The MFLO
+		 * must not be a branch target, which is guaranteed if there is
+		 * no sync opcode between the two. */
+		next = list->next;
+		if (is_mult && next && next->i.op == OP_SPECIAL &&
+		    next->r.op == OP_SPECIAL_MFLO) {
+			pr_debug("Merge MFLO into MULT(U) opcode at offset 0x%x\n",
+				 list->offset << 2);
+			list->r.rd = next->r.rd;
+			next->opcode = 0;
+		}
+
+		if (hilo_reg_is_dead(block, list, REG_HI)) {
+			pr_debug("HI is dead after opcode at offset 0x%x\n",
+				 list->offset << 2);
+			list->flags |= LIGHTREC_NO_HI;
+		}
+
+		if (hilo_reg_is_dead(block, list, REG_LO)) {
+			pr_debug("LO is dead after opcode at offset 0x%x\n",
+				 list->offset << 2);
+			list->flags |= LIGHTREC_NO_LO;
+		}
+
+		/* Nothing is used from the result: drop the opcode */
+		if ((list->flags & LIGHTREC_NO_HI) &&
+		    (list->flags & LIGHTREC_NO_LO) && !list->r.rd) {
+			pr_debug("Removing dead opcode at offset 0x%x\n",
+				 list->offset << 2);
+			list->opcode = 0;
 		}
 	}
 
 	return 0;
 }
 
-static int (*lightrec_optimizers[])(struct block *) = {
-	&lightrec_detect_impossible_branches,
-	&lightrec_transform_ops,
-	&lightrec_local_branches,
-	&lightrec_switch_delay_slots,
-	&lightrec_flag_stores,
-	&lightrec_flag_mults,
-	&lightrec_early_unload,
+/* LWL/LWR or SWL/SWR pair accessing the same (unaligned) word */
+static bool is_unaligned_pair(const struct opcode *op,
+			      const struct opcode *next)
+{
+	const struct opcode *left, *right;
+
+	if (op->i.rs != next->i.rs || op->i.rt != next->i.rt)
+		return false;
+
+	switch (op->i.op) {
+	case OP_LWL:
+	case OP_SWL:
+		left = op;
+		right = next;
+		break;
+	case OP_LWR:
+	case OP_SWR:
+		left = next;
+		right = op;
+		break;
+	default:
+		return false;
+	}
+
+	if ((left->i.op == OP_LWL && right->i.op != OP_LWR) ||
+	    (left->i.op == OP_SWL && right->i.op != OP_SWR))
+		return false;
+
+	/* The first load would modify the base register of the second one */
+	if (left->i.op == OP_LWL && op->i.rs == op->i.rt)
+		return false;
+
+	return (s16)left->i.imm == (s16)right->i.imm + 3;
+}
+
+static int lightrec_flag_unaligned_pairs(struct block *block)
+{
+	struct opcode *list, *prev;
+
+	for (list = block->opcode_list, prev = NULL; list && list->next;
+	     prev = list, list = list->next) {
+		/* Don't merge a delay slot. The second opcode can't be a
+		 * branch target, as a sync opcode would be in between. */
+		if (prev && has_delay_slot(prev->c))
+			continue;
+
+		if (is_unaligned_pair(list, list->next)) {
+			pr_debug("Found unaligned access pair at offset 0x%x\n",
+				 list->offset << 2);
+			list->flags |= LIGHTREC_UNALIGNED_PAIR;
+
+			/* Skip the second opcode of the pair */
+			prev = list;
+			list = list->next;
+		}
+	}
+
+	return 0;
+}
+
+static bool is_coalescable_io(union code c)
+{
+	switch (c.i.op) {
+	case OP_LB:
+	case OP_LBU:
+	case OP_LH:
+	case OP_LHU:
+	case OP_LW:
+	case OP_SB:
+	case OP_SH:
+	case OP_SW:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static int lightrec_flag_coalesced_io(struct block *block)
+{
+	struct opcode *list, *prev, *last = NULL;
+
+	for (list = block->opcode_list, prev = NULL; list;
+	     prev = list, list = list->next) {
+		/* Unloading registers doesn't break a run */
+		if (list->i.op == OP_META_REG_UNLOAD)
+			continue;
+
+		if (!is_coalescable_io(list->c) ||
+		    (prev && has_delay_slot(prev->c))) {
+			last = NULL;
+			continue;
+		}
+
+		/* Flag loads/stores that use the same base register as the
+		 * previous one; the emitter will translate the address of the
+		 * base only once for the whole run. */
+		if (last && last->i.rs == list->i.rs) {
+			pr_debug("Coalescing I/O opcode at offset 0x%x\n",
+				 list->offset << 2);
+			list->flags |= LIGHTREC_COALESCED;
+		}
+
+		/* A load to the base register ends the run */
+		if (opcode_writes_register(list->c, list->i.rs))
+			last = NULL;
+		else
+			last = list;
+	}
+
+	return 0;
+}
+
+static const struct lightrec_mem_map_ops *
+get_batch_ops(struct block *block, const struct opcode *op,
+	      u32 known, const u32 *values)
+{
+	const struct lightrec_mem_map *map;
+
+	if (op->i.op != OP_SW || !(known & BIT(op->i.rs)))
+		return NULL;
+
+	map = lightrec_get_map(block->state,
+			       kunseg(values[op->i.rs] + (s16)op->i.imm));
+	if (!map || !map->ops || !map->ops->sw_batch)
+		return NULL;
+
+	return map->ops;
+}
+
+static int lightrec_flag_io_batches(struct block *block)
+{
+	const struct lightrec_mem_map_ops *ops, *prev_ops = NULL;
+	struct opcode *list, *prev;
+	u32 known = BIT(0);
+	u32 values[32] = { 0 };
+
+	for (list = block->opcode_list, prev = NULL; list;
+	     prev = list, list = list->next) {
+		/* Register $zero is always, well, zero */
+		known |= BIT(0);
+		values[0] = 0;
+
+		/* Don't start a batch in a delay slot */
+		if (prev && has_delay_slot(prev->c))
+			ops = NULL;
+		else
+			ops = get_batch_ops(block, list, known, values);
+
+		/* Flag stores to HW registers that directly follow another
+		 * one to the same map; they will be merged into a single call
+		 * to the sw_batch callback. */
+		if (ops && ops == prev_ops) {
+			pr_debug("Batching SW opcode at offset 0x%x\n",
+				 list->offset << 2);
+			list->flags |= LIGHTREC_BATCHED;
+		}
+
+		prev_ops = ops;
+		known = lightrec_propagate_consts(list->c, known, values);
+	}
+
+	return 0;
+}
+
+struct bulk_inc {
+	u8 reg;
+	s16 imm;
+	unsigned int pos;
+};
+
+static const struct bulk_inc *
+bulk_find_inc(const struct bulk_inc *incs, unsigned int nb, u8 reg)
+{
+	unsigned int i;
+
+	for (i = 0; i < nb; i++)
+		if (incs[i].reg == reg)
+			return &incs[i];
+
+	return NULL;
+}
+
+static bool bulk_add_op(const struct opcode *op, unsigned int pos,
+			const struct opcode **lw, unsigned int *lw_pos,
+			const struct opcode **sw, unsigned int *sw_pos,
+			struct bulk_inc *incs, unsigned int *nb_incs)
+{
+	switch (op->i.op) {
+	case OP_LW:
+		if (*lw || *sw)
+			return false;
+
+		*lw = op;
+		*lw_pos = pos;
+		return true;
+	case OP_SW:
+		if (*sw)
+			return false;
+
+		*sw = op;
+		*sw_pos = pos;
+		return true;
+	case OP_ADDIU:
+		if (!op->i.rt || op->i.rt != op->i.rs ||
+		    *nb_incs == 3 || bulk_find_inc(incs, *nb_incs, op->i.rt))
+			return false;
+
+		incs[*nb_incs].reg = op->i.rt;
+		incs[*nb_incs].imm = (s16)op->i.imm;
+		incs[(*nb_incs)++].pos = pos;
+		return true;
+	default:
+		return op->c.opcode == 0;
+	}
+}
+
+/* Recognize a word copy or fill loop starting at the given sync point:
+ *
+ *   loop: [lw  data, imm(src)]
+ *         sw   data, imm(dst)
+ *         addiu dst, dst, 4
+ *         [addiu src, src, 4]
+ *         [addiu cnt, cnt, step]
+ *         bne  cnt, end, loop
+ *
+ * in any order, with the LW before the SW and the increments anywhere in
+ * the loop, including the delay slot. */
+bool lightrec_get_bulk_loop(const struct block *block,
+			    const struct opcode *sync,
+			    struct lightrec_bulk_loop *loop)
+{
+	const struct opcode *op, *lw = NULL, *sw = NULL, *branch = NULL;
+	const struct bulk_inc *inc, *cnt_inc;
+	struct bulk_inc incs[3];
+	unsigned int pos = 0, lw_pos = 0, sw_pos = 0, br_pos = 0;
+	unsigned int nb_incs = 0, cycles = 0;
+	u8 data, rs, rt;
+
+	if (sync->j.op != OP_META_SYNC)
+		return false;
+
+	for (op = sync->next; op; op = op->next) {
+		if (op->i.op == OP_META_REG_UNLOAD)
+			continue;
+
+		cycles += lightrec_cycles_of_opcode(op->c);
+
+		if (branch) {
+			/* Delay slot of the loop branch */
+			if (!bulk_add_op(op, pos, &lw, &lw_pos, &sw, &sw_pos,
+					 incs, &nb_incs))
+				return false;
+			break;
+		}
+
+		if (has_delay_slot(op->c)) {
+			if (!(op->flags & LIGHTREC_LOCAL_BRANCH) ||
+			    (op->i.op != OP_BNE && op->i.op != OP_META_BNEZ) ||
+			    op->offset + 1 + (s16)op->i.imm != sync->offset)
+				return false;
+
+			branch = op;
+			br_pos = pos++;
+
+			if (op->flags & LIGHTREC_NO_DS)
+				break;
+			continue;
+		}
+
+		if (!bulk_add_op(op, pos++, &lw, &lw_pos, &sw, &sw_pos,
+				 incs, &nb_incs))
+			return false;
+	}
+
+	if (!branch || !sw || cycles > 0xff)
+		return false;
+
+	loop->dst = sw->i.rs;
+	inc = bulk_find_inc(incs, nb_incs, loop->dst);
+	if (!inc || inc->imm != 4)
+		return false;
+
+	loop->dst_off = (s16)sw->i.imm + (inc->pos < sw_pos ? 4 : 0);
+	data = sw->i.rt;
+
+	if (lw) {
+		loop->src = lw->i.rs;
+		inc = bulk_find_inc(incs, nb_incs, loop->src);
+		if (!inc || inc->imm != 4 || loop->src == loop->dst ||
+		    !data || lw->i.rt != data)
+			return false;
+
+		loop->src_off = (s16)lw->i.imm + (inc->pos < lw_pos ? 4 : 0);
+	} else {
+		loop->src = 0;
+		loop->src_off = 0;
+	}
+
+	/* The data register must be invariant, or only written by the LW */
+	if (bulk_find_inc(incs, nb_incs, data))
+		return false;
+
+	loop->data = data;
+
+	/* One of the compared registers is the counter, the other one holds
+	 * the end value */
+	rs = branch->i.rs;
+	rt = branch->i.rt;
+	cnt_inc = bulk_find_inc(incs, nb_incs, rs);
+	inc = bulk_find_inc(incs, nb_incs, rt);
+	if (!!cnt_inc == !!inc)
+		return false;
+
+	if (inc) {
+		cnt_inc = inc;
+		loop->end = rs;
+	} else {
+		loop->end = rt;
+	}
+
+	if (lw && loop->end == data)
+		return false;
+
+	loop->cnt = cnt_inc->reg;
+	loop->cnt_step = cnt_inc->imm;
+	loop->cnt_pre = cnt_inc->pos < br_pos;
+
+	if (!loop->cnt_step)
+		return false;
+
+	/* No other register can be modified */
+	if (nb_incs != 1 + !!loop->src +
+	    (loop->cnt != loop->dst && loop->cnt != loop->src))
+		return false;
+
+	loop->cycles = cycles;
+
+	return true;
+}
+
+static int lightrec_flag_bulk_loops(struct block *block)
+{
+	struct lightrec_bulk_loop loop;
+	struct opcode *list;
+
+	for (list = block->opcode_list; list; list = list->next) {
+		if (list->j.op == OP_META_SYNC &&
+		    lightrec_get_bulk_loop(block, list, &loop)) {
+			pr_debug("Found %s loop at offset 0x%x\n",
+				 loop.src ? "copy" : "fill", list->offset << 2);
+			list->flags |= LIGHTREC_BULK_LOOP;
+		}
+	}
+
+	return 0;
+}
+
+static bool is_idle_loop_op(const struct opcode *op)
+{
+	switch (op->i.op) {
+	case OP_SPECIAL:
+		switch (op->r.op) {
+		case OP_SPECIAL_SLL:
+		case OP_SPECIAL_SRL:
+		case OP_SPECIAL_SRA:
+		case OP_SPECIAL_SLLV:
+		case OP_SPECIAL_SRLV:
+		case OP_SPECIAL_SRAV:
+		case OP_SPECIAL_ADDU:
+		case OP_SPECIAL_SUBU:
+		case OP_SPECIAL_AND:
+		case OP_SPECIAL_OR:
+		case OP_SPECIAL_XOR:
+		case OP_SPECIAL_NOR:
+		case OP_SPECIAL_SLT:
+		case OP_SPECIAL_SLTU:
+			return true;
+		default:
+			return false;
+		}
+	case OP_ADDIU:
+	case OP_SLTI:
+	case OP_SLTIU:
+	case OP_ANDI:
+	case OP_ORI:
+	case OP_XORI:
+	case OP_LUI:
+	case OP_META_MOV:
+		return true;
+	case OP_LB:
+	case OP_LBU:
+	case OP_LH:
+	case OP_LHU:
+	case OP_LW:
+		/* Only reads from memory that can't have side effects */
+		return !!(op->flags & LIGHTREC_DIRECT_IO);
+	default:
+		return false;
+	}
+}
+
+static void idle_loop_add_op(union code c, u32 *read_first, u32 *written)
+{
+	unsigned int i;
+
+	for (i = 1; i < 32; i++) {
+		if (opcode_reads_register(c, i) && !(*written & BIT(i)))
+			*read_first |= BIT(i);
+	}
+
+	for (i = 1; i < 32; i++) {
+		if (opcode_writes_register(c, i))
+			*written |= BIT(i);
+	}
+}
+
+/* Check if the backward local branch loops on a body without side effects,
+ * whose iterations all compute the same values as long as the memory they
+ * read is not modified (by an interrupt handler or a DMA). */
+static bool is_idle_loop(const struct block *block, const struct opcode *branch)
+{
+	const struct opcode *sync, *op;
+	u32 read_first = 0, written = 0;
+	s32 offset = branch->offset + 1 + (s16)branch->i.imm;
+
+	for (sync = block->opcode_list; sync; sync = sync->next)
+		if (sync->j.op == OP_META_SYNC && sync->offset == offset)
+			break;
+
+	if (!sync)
+		return false;
+
+	for (op = sync->next; op != branch; op = op->next) {
+		if (!op)
+			return false;
+
+		if (op->i.op == OP_META_REG_UNLOAD || op->c.opcode == 0)
+			continue;
+
+		if (!is_idle_loop_op(op))
+			return false;
+
+		idle_loop_add_op(op->c, &read_first, &written);
+	}
+
+	idle_loop_add_op(branch->c, &read_first, &written);
+
+	if (!(branch->flags & LIGHTREC_NO_DS)) {
+		op = branch->next;
+
+		if (op->c.opcode) {
+			if (!is_idle_loop_op(op))
+				return false;
+
+			idle_loop_add_op(op->c, &read_first, &written);
+		}
+	}
+
+	/* Reject loops that carry a value over to the next iteration */
+	return !(read_first & written);
+}
+
+static int lightrec_flag_idle_loops(struct block *block)
+{
+	struct opcode *list;
+
+	for (list = block->opcode_list; list; list = list->next) {
+		if (!(list->flags & LIGHTREC_LOCAL_BRANCH) ||
+		    (s16)list->i.imm >= -1)
+			continue;
+
+		if (is_idle_loop(block, list)) {
+			pr_debug("Found idle loop at offset 0x%x\n",
+				 list->offset << 2);
+			list->flags |= LIGHTREC_IDLE_LOOP;
+		}
+	}
+
+	return 0;
+}
+
+static const struct lightrec_optimizer {
+	int (*func)(struct block *);
+	const char *name;
+} lightrec_optimizers[] = {
+	{ &lightrec_detect_impossible_branches, "detect_impossible_branches" },
+	{ &lightrec_transform_ops, "transform_ops" },
+	{ &lightrec_local_branches, "local_branches" },
+	{ &lightrec_switch_delay_slots, "switch_delay_slots" },
+	{ &lightrec_flag_stores, "flag_stores" },
+	{ &lightrec_flag_const_io, "flag_const_io" },
+	{ &lightrec_flag_mults, "flag_mults" },
+	{ &lightrec_early_unload, "early_unload" },
+	{ &lightrec_flag_unaligned_pairs, "flag_unaligned_pairs" },
+	{ &lightrec_flag_coalesced_io, "flag_coalesced_io" },
+	{ &lightrec_flag_io_batches, "flag_io_batches" },
+	{ &lightrec_flag_bulk_loops, "flag_bulk_loops" },
+	{ &lightrec_flag_idle_loops, "flag_idle_loops" },
 };
 
+const char * lightrec_optimizer_name(unsigned int pass)
+{
+	if (pass >= ARRAY_SIZE(lightrec_optimizers))
+		return NULL;
+
+	return lightrec_optimizers[pass].name;
+}
+
 int lightrec_optimize(struct block *block)
 {
 	unsigned int i;
+	int ret;
+#if ENABLE_COMPILER_STATS
+	struct lightrec_compiler_stats *stats = &block->state->compiler_stats;
+	u64 start;
+#endif
 
 	for (i = 0; i < ARRAY_SIZE(lightrec_optimizers); i++) {
-		int ret = lightrec_optimizers[i](block);
+#if ENABLE_COMPILER_STATS
+		start = lightrec_get_time_ns();
+#endif
+
+		ret = lightrec_optimizers[i].func(block);
+
+#if ENABLE_COMPILER_STATS
+		if (i < LIGHTREC_STATS_MAX_PASSES)
+			lightrec_stats_add(&stats->passes[i], start);
+#endif
 
 		if (ret)
 			return ret;
@@ -18,12 +18,29 @@
 #include "disassembler.h"
 
 struct block;
+struct opcode;
+
+/* Word copy/fill loop, see lightrec_get_bulk_loop() */
+struct lightrec_bulk_loop {
+	u8 dst, src, data, cnt, end;
+	_Bool cnt_pre;
+	s16 dst_off, src_off, cnt_step;
+	u8 cycles;
+};
 
 _Bool opcode_reads_register(union code op, u8 reg);
 _Bool opcode_writes_register(union code op, u8 reg);
 _Bool has_delay_slot(union code op);
+_Bool is_syscall_or_break(union code op);
 _Bool load_in_delay_slot(union code op);
 
+u32 lightrec_propagate_consts(union code c, u32 known, u32 *v);
+
 int lightrec_optimize(struct block *block);
+const char * lightrec_optimizer_name(unsigned int pass);
+
+_Bool lightrec_get_bulk_loop(const struct block *block,
+			     const struct opcode *sync,
+			     struct lightrec_bulk_loop *loop);
 
 #endif /* __OPTIMIZER_H__ */
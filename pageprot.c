@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2020 Paul Cercueil <paul@crapouillou.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* For sigaction(), mprotect() and sysconf() */
+#define _POSIX_C_SOURCE 200809L
+
+#include "debug.h"
+#include "lightrec-private.h"
+#include "memmanager.h"
+#include "pageprot.h"
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Maximum number of host pages covering the RAM (for 4 KiB pages) */
+#define MAX_PAGES (RAM_SIZE >> 12)
+
+struct pageprot {
+	struct lightrec_state *state;
+	struct sigaction old_sa;
+	uintptr_t base;
+	unsigned int nb_views;
+	unsigned int page_size;
+	unsigned int nb_pages;
+	bool protected[MAX_PAGES];
+
+	/* Index of the first page of the lowest block overlapping each page */
+	u16 first_page[MAX_PAGES];
+};
+
+/* Signal handlers are process-wide, so only one instance is supported */
+static struct pageprot *pageprot_instance;
+
+static void lightrec_pageprot_set(struct pageprot *pp,
+				  unsigned int page, bool protect)
+{
+	int prot = protect ? PROT_READ : PROT_READ | PROT_WRITE;
+	uintptr_t addr = pp->base + page * pp->page_size;
+	unsigned int i;
+
+	/* When the RAM mirrors are mapped, each view has its own set of
+	 * page table entries, so all of them must be updated */
+	for (i = 0; i < pp->nb_views; i++)
+		mprotect((void *)(addr + i * RAM_SIZE), pp->page_size, prot);
+
+	pp->protected[page] = protect;
+}
+
+static void lightrec_pageprot_handler(int sig, siginfo_t *info, void *ctx)
+{
+	struct pageprot *pp = pageprot_instance;
+	uintptr_t addr = (uintptr_t)info->si_addr;
+	unsigned int page, first;
+	u32 offset;
+
+	if (pp && addr >= pp->base &&
+	    addr < pp->base + pp->nb_views * RAM_SIZE) {
+		offset = (addr - pp->base) & (RAM_SIZE - 1);
+		page = offset / pp->page_size;
+
+		if (pp->protected[page]) {
+			first = pp->first_page[page];
+
+			lightrec_pageprot_set(pp, page, false);
+			pp->first_page[page] = page;
+
+			/* Mark as outdated all the blocks starting in this
+			 * page, or in a previous page but overlapping it */
+			offset = first * pp->page_size;
+			for (; offset < (page + 1) * pp->page_size; offset += 4)
+				pp->state->code_lut[lut_offset(offset)] = NULL;
+			return;
+		}
+	}
+
+	/* Not a write to a protected code page - forward the signal */
+	if (pp && (pp->old_sa.sa_flags & SA_SIGINFO)) {
+		pp->old_sa.sa_sigaction(sig, info, ctx);
+	} else if (pp && pp->old_sa.sa_handler != SIG_DFL &&
+		   pp->old_sa.sa_handler != SIG_IGN) {
+		pp->old_sa.sa_handler(sig);
+	} else {
+		/* Restore the default handler; the faulting instruction
+		 * will be executed again and crash the process */
+		signal(sig, SIG_DFL);
+	}
+}
+
+void lightrec_pageprot_block(struct pageprot *pp, const struct block *block)
+{
+	u32 kaddr = kunseg(block->pc);
+	unsigned int first, last, page;
+
+	if (kaddr >= RAM_SIZE * 4)
+		return;
+
+	kaddr &= RAM_SIZE - 1;
+	first = kaddr / pp->page_size;
+	last = (kaddr + block->nb_ops * sizeof(u32) - 1) / pp->page_size;
+
+	if (last >= pp->nb_pages)
+		last = pp->nb_pages - 1;
+
+	for (page = first; page <= last; page++) {
+		if (first < pp->first_page[page])
+			pp->first_page[page] = first;
+
+		if (!pp->protected[page]) {
+			pr_debug("Write-protecting RAM page 0x%x\n",
+				 page * pp->page_size);
+			lightrec_pageprot_set(pp, page, true);
+		}
+	}
+}
+
+struct pageprot * lightrec_pageprot_init(struct lightrec_state *state)
+{
+	const struct lightrec_mem_map *map = &state->maps[PSX_MAP_KERNEL_USER_RAM];
+	struct sigaction sa;
+	struct pageprot *pp;
+	unsigned int i;
+	long page_size;
+
+	if (pageprot_instance) {
+		pr_warn("Page protection already used by another instance\n");
+		return NULL;
+	}
+
+	page_size = sysconf(_SC_PAGESIZE);
+	if (page_size < 4096 || page_size > RAM_SIZE ||
+	    ((uintptr_t)map->address & (page_size - 1))) {
+		pr_warn("RAM is not page-aligned, cannot use page protection\n");
+		return NULL;
+	}
+
+	pp = lightrec_calloc(state, MEM_FOR_LIGHTREC, sizeof(*pp));
+	if (!pp)
+		return NULL;
+
+	pp->state = state;
+	pp->base = (uintptr_t)map->address;
+	pp->nb_views = state->mirrors_mapped ? 4 : 1;
+	pp->page_size = page_size;
+	pp->nb_pages = RAM_SIZE / page_size;
+
+	for (i = 0; i < pp->nb_pages; i++)
+		pp->first_page[i] = i;
+
+	sa.sa_sigaction = lightrec_pageprot_handler;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+
+	if (sigaction(SIGSEGV, &sa, &pp->old_sa)) {
+		pr_err("Unable to install SIGSEGV handler\n");
+		lightrec_free(state, MEM_FOR_LIGHTREC, sizeof(*pp), pp);
+		return NULL;
+	}
+
+	pageprot_instance = pp;
+
+	pr_info("Using page protection to detect self-modifying code\n");
+
+	return pp;
+}
+
+void lightrec_free_pageprot(struct pageprot *pp)
+{
+	unsigned int i;
+
+	/* The RAM belongs to the frontend, leave it writable */
+	for (i = 0; i < pp->nb_pages; i++)
+		if (pp->protected[i])
+			lightrec_pageprot_set(pp, i, false);
+
+	sigaction(SIGSEGV, &pp->old_sa, NULL);
+	pageprot_instance = NULL;
+
+	lightrec_free(pp->state, MEM_FOR_LIGHTREC, sizeof(*pp), pp);
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright (C) 2020 Paul Cercueil <paul@crapouillou.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef __LIGHTREC_PAGEPROT_H__
+#define __LIGHTREC_PAGEPROT_H__
+
+struct block;
+struct lightrec_state;
+struct pageprot;
+
+struct pageprot * lightrec_pageprot_init(struct lightrec_state *state);
+void lightrec_free_pageprot(struct pageprot *pp);
+
+void lightrec_pageprot_block(struct pageprot *pp, const struct block *block);
+
+#endif /* __LIGHTREC_PAGEPROT_H__ */
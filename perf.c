@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2020 Paul Cercueil <paul@crapouillou.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* For fdopen(), flockfile(), mmap() and syscall() */
+#define _GNU_SOURCE
+
+#include "debug.h"
+#include "lightrec-private.h"
+#include "memmanager.h"
+#include "perf.h"
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* See tools/perf/Documentation/jitdump-specification.txt in the kernel */
+#define JITDUMP_MAGIC		0x4a695444
+#define JITDUMP_VERSION		1
+
+#define JIT_CODE_LOAD		0
+#define JIT_CODE_CLOSE		3
+
+#if defined(__x86_64__)
+#	define JITDUMP_ELF_MACH	EM_X86_64
+#elif defined(__i386__)
+#	define JITDUMP_ELF_MACH	EM_386
+#elif defined(__aarch64__)
+#	define JITDUMP_ELF_MACH	EM_AARCH64
+#elif defined(__arm__)
+#	define JITDUMP_ELF_MACH	EM_ARM
+#elif defined(__powerpc64__)
+#	define JITDUMP_ELF_MACH	EM_PPC64
+#elif defined(__powerpc__)
+#	define JITDUMP_ELF_MACH	EM_PPC
+#elif defined(__mips__)
+#	define JITDUMP_ELF_MACH	EM_MIPS
+#else
+#	define JITDUMP_ELF_MACH	EM_NONE
+#endif
+
+struct jitdump_header {
+	u32 magic;
+	u32 version;
+	u32 total_size;
+	u32 elf_mach;
+	u32 pad1;
+	u32 pid;
+	u64 timestamp;
+	u64 flags;
+};
+
+struct jitdump_record {
+	u32 id;
+	u32 total_size;
+	u64 timestamp;
+};
+
+struct jitdump_code_load {
+	struct jitdump_record p;
+	u32 pid;
+	u32 tid;
+	u64 vma;
+	u64 code_addr;
+	u64 code_size;
+	u64 code_index;
+	/* Followed by the NULL-terminated name and the code */
+};
+
+struct lightrec_perf {
+	struct lightrec_state *state;
+	FILE *map, *jitdump;
+	void *marker;
+	size_t marker_size;
+	u64 code_index;
+	pid_t pid;
+};
+
+static int lightrec_perf_open_jitdump(struct lightrec_perf *perf)
+{
+	struct jitdump_header header = {
+		.magic = JITDUMP_MAGIC,
+		.version = JITDUMP_VERSION,
+		.total_size = sizeof(header),
+		.elf_mach = JITDUMP_ELF_MACH,
+		.pid = perf->pid,
+	};
+	char path[64];
+	int fd;
+
+	snprintf(path, sizeof(path), "/tmp/jit-%d.dump", perf->pid);
+
+	fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0666);
+	if (fd < 0)
+		return -errno;
+
+	/* perf record only notices the jitdump file if it is mapped as
+	 * executable; 'perf inject --jit' will then pick it up */
+	perf->marker_size = sysconf(_SC_PAGESIZE);
+	perf->marker = mmap(NULL, perf->marker_size, PROT_READ | PROT_EXEC,
+			    MAP_PRIVATE, fd, 0);
+	if (perf->marker == MAP_FAILED) {
+		close(fd);
+		return -errno;
+	}
+
+	perf->jitdump = fdopen(fd, "w");
+	if (!perf->jitdump) {
+		munmap(perf->marker, perf->marker_size);
+		close(fd);
+		return -ENOMEM;
+	}
+
+	/* CLOCK_MONOTONIC: perf must be run with -k mono to match these */
+	header.timestamp = lightrec_get_time_ns();
+	fwrite(&header, sizeof(header), 1, perf->jitdump);
+	fflush(perf->jitdump);
+
+	return 0;
+}
+
+struct lightrec_perf * lightrec_perf_init(struct lightrec_state *state,
+					  unsigned int flags)
+{
+	struct lightrec_perf *perf;
+	char path[64];
+	int ret;
+
+	perf = lightrec_calloc(state, MEM_FOR_LIGHTREC, sizeof(*perf));
+	if (!perf) {
+		pr_err("Unable to init perf output: Out of memory\n");
+		return NULL;
+	}
+
+	perf->state = state;
+	perf->pid = getpid();
+
+	if (flags & LIGHTREC_PERF_MAP) {
+		snprintf(path, sizeof(path), "/tmp/perf-%d.map", perf->pid);
+
+		perf->map = fopen(path, "w");
+		if (!perf->map) {
+			pr_err("Unable to open %s\n", path);
+			goto err_free_perf;
+		}
+	}
+
+	if (flags & LIGHTREC_PERF_JITDUMP) {
+		ret = lightrec_perf_open_jitdump(perf);
+		if (ret) {
+			pr_err("Unable to create jitdump file: %d\n", ret);
+			goto err_close_map;
+		}
+	}
+
+	return perf;
+
+err_close_map:
+	if (perf->map)
+		fclose(perf->map);
+err_free_perf:
+	lightrec_free(state, MEM_FOR_LIGHTREC, sizeof(*perf), perf);
+	return NULL;
+}
+
+void lightrec_free_perf(struct lightrec_perf *perf)
+{
+	struct jitdump_record close_rec = {
+		.id = JIT_CODE_CLOSE,
+		.total_size = sizeof(close_rec),
+	};
+
+	if (perf->jitdump) {
+		close_rec.timestamp = lightrec_get_time_ns();
+		fwrite(&close_rec, sizeof(close_rec), 1, perf->jitdump);
+		fclose(perf->jitdump);
+		munmap(perf->marker, perf->marker_size);
+	}
+
+	if (perf->map)
+		fclose(perf->map);
+
+	lightrec_free(perf->state, MEM_FOR_LIGHTREC, sizeof(*perf), perf);
+}
+
+void lightrec_perf_register(struct lightrec_perf *perf, const void *code,
+			    size_t size, const char *name)
+{
+	struct jitdump_code_load rec;
+	size_t name_len;
+
+	if (perf->map) {
+		fprintf(perf->map, "%lx %zx %s\n",
+			(unsigned long)(uintptr_t)code, size, name);
+		fflush(perf->map);
+	}
+
+	if (!perf->jitdump)
+		return;
+
+	name_len = strlen(name) + 1;
+
+	rec = (struct jitdump_code_load) {
+		.p = {
+			.id = JIT_CODE_LOAD,
+			.total_size = sizeof(rec) + name_len + size,
+			.timestamp = lightrec_get_time_ns(),
+		},
+		.pid = perf->pid,
+		.tid = syscall(SYS_gettid),
+		.vma = (uintptr_t)code,
+		.code_addr = (uintptr_t)code,
+		.code_size = size,
+	};
+
+	/* Blocks can be compiled from the recompiler thread */
+	flockfile(perf->jitdump);
+
+	rec.code_index = perf->code_index++;
+
+	fwrite(&rec, sizeof(rec), 1, perf->jitdump);
+	fwrite(name, name_len, 1, perf->jitdump);
+	fwrite(code, size, 1, perf->jitdump);
+	fflush(perf->jitdump);
+
+	funlockfile(perf->jitdump);
+}
+
+void lightrec_perf_register_block(struct lightrec_perf *perf,
+				  const struct block *block)
+{
+	char name[16];
+
+	snprintf(name, sizeof(name), "blk_%08x", block->pc);
+
+	lightrec_perf_register(perf, block->function, block->code_size, name);
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2020 Paul Cercueil <paul@crapouillou.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef __LIGHTREC_PERF_H__
+#define __LIGHTREC_PERF_H__
+
+#include <stddef.h>
+
+struct block;
+struct lightrec_perf;
+struct lightrec_state;
+
+struct lightrec_perf * lightrec_perf_init(struct lightrec_state *state,
+					  unsigned int flags);
+void lightrec_free_perf(struct lightrec_perf *perf);
+
+void lightrec_perf_register(struct lightrec_perf *perf, const void *code,
+			    size_t size, const char *name);
+void lightrec_perf_register_block(struct lightrec_perf *perf,
+				  const struct block *block);
+
+#endif /* __LIGHTREC_PERF_H__ */
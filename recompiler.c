@@ -16,6 +16,7 @@
 #include "interpreter.h"
 #include "lightrec-private.h"
 #include "memmanager.h"
+#include "recompiler.h"
 
 #include <errno.h>
 #include <stdatomic.h>
@@ -26,6 +27,9 @@
 struct block_rec {
 	struct block *block;
 	struct block_rec *next;
+#if ENABLE_COMPILER_STATS
+	u64 enqueue_time;
+#endif
 };
 
 struct recompiler {
@@ -33,32 +37,90 @@ struct recompiler {
 	pthread_t thd;
 	pthread_cond_t cond;
 	pthread_mutex_t mutex;
-	bool stop;
+	bool stop, paused;
 	struct block *current_block;
 	struct block_rec *list;
+
+	/* Speculative compilations, only processed when idle */
+	struct block_rec *spec_list;
+
+#if ENABLE_COMPILER_STATS
+	struct lightrec_stage_stats queue_wait;
+	u32 queue_depth, max_queue_depth;
+	u32 queue_histogram[LIGHTREC_STATS_HIST_SIZE];
+	u64 nb_interpreted;
+#endif
 };
 
-static void slist_remove(struct recompiler *rec, struct block_rec *elm)
+static void lightrec_recompiler_queued(struct recompiler *rec,
+				       struct block_rec *block_rec)
+{
+#if ENABLE_COMPILER_STATS
+	block_rec->enqueue_time = lightrec_get_time_ns();
+
+	rec->queue_depth++;
+	if (rec->queue_depth > rec->max_queue_depth)
+		rec->max_queue_depth = rec->queue_depth;
+
+	rec->queue_histogram[lightrec_stats_bucket(rec->queue_depth)]++;
+#endif
+}
+
+static void lightrec_recompiler_dequeued(struct recompiler *rec)
+{
+#if ENABLE_COMPILER_STATS
+	rec->queue_depth--;
+#endif
+}
+
+static bool slist_remove_from(struct block_rec **list, struct block_rec *elm)
 {
 	struct block_rec *prev;
 
-	if (rec->list == elm) {
-		rec->list = elm->next;
-	} else {
-		for (prev = rec->list; prev && prev->next != elm; )
-			prev = prev->next;
-		if (prev)
-			prev->next = elm->next;
+	if (*list == elm) {
+		*list = elm->next;
+		return true;
 	}
+
+	for (prev = *list; prev && prev->next != elm; )
+		prev = prev->next;
+	if (!prev)
+		return false;
+
+	prev->next = elm->next;
+	return true;
+}
+
+static void slist_remove(struct recompiler *rec, struct block_rec *elm)
+{
+	if (!slist_remove_from(&rec->list, elm))
+		slist_remove_from(&rec->spec_list, elm);
+}
+
+static struct block_rec ** slist_find(struct block_rec **list,
+				      const struct block *block)
+{
+	for (; *list; list = &(*list)->next)
+		if ((*list)->block == block)
+			return list;
+
+	return NULL;
 }
 
 static void lightrec_compile_list(struct recompiler *rec)
 {
 	struct block_rec *next;
 	struct block *block;
+	bool speculative;
 	int ret;
 
-	while (!!(next = rec->list)) {
+	for (;;) {
+		/* Speculative compilations only run when idle */
+		speculative = !rec->list;
+		next = speculative ? rec->spec_list : rec->list;
+		if (!next || rec->paused)
+			break;
+
 		block = next->block;
 		rec->current_block = block;
 
@@ -72,7 +134,15 @@ static void lightrec_compile_list(struct recompiler *rec)
 
 		pthread_mutex_lock(&rec->mutex);
 
+#if ENABLE_COMPILER_STATS
+		/* Only measure the latency of blocks that were waited for */
+		if (!speculative)
+			lightrec_stats_add(&rec->queue_wait,
+					   next->enqueue_time);
+#endif
+
 		slist_remove(rec, next);
+		lightrec_recompiler_dequeued(rec);
 		lightrec_free(rec->state, MEM_FOR_LIGHTREC,
 			      sizeof(*next), next);
 		pthread_cond_signal(&rec->cond);
@@ -96,7 +166,7 @@ static void * lightrec_recompiler_thd(void *d)
 				return NULL;
 			}
 
-		} while (!rec->list);
+		} while (rec->paused || (!rec->list && !rec->spec_list));
 
 		lightrec_compile_list(rec);
 	}
@@ -115,8 +185,10 @@ struct recompiler *lightrec_recompiler_init(struct lightrec_state *state)
 
 	rec->state = state;
 	rec->stop = false;
+	rec->paused = false;
 	rec->current_block = NULL;
 	rec->list = NULL;
+	rec->spec_list = NULL;
 
 	ret = pthread_cond_init(&rec->cond, NULL);
 	if (ret) {
@@ -130,6 +202,11 @@ struct recompiler *lightrec_recompiler_init(struct lightrec_state *state)
 		goto err_cnd_destroy;
 	}
 
+#if ENABLE_COMPILER_STATS
+	rec->queue_depth = 0;
+	lightrec_recompiler_reset_stats(rec);
+#endif
+
 	ret = pthread_create(&rec->thd, NULL, lightrec_recompiler_thd, rec);
 	if (ret) {
 		pr_err("Cannot create recompiler thread: %d\n", ret);
@@ -164,7 +241,7 @@ void lightrec_free_recompiler(struct recompiler *rec)
 
 int lightrec_recompiler_add(struct recompiler *rec, struct block *block)
 {
-	struct block_rec *block_rec, *prev;
+	struct block_rec *block_rec, *prev, **elm;
 
 	pthread_mutex_lock(&rec->mutex);
 
@@ -184,6 +261,25 @@ int lightrec_recompiler_add(struct recompiler *rec, struct block *block)
 		}
 	}
 
+	elm = slist_find(&rec->spec_list, block);
+	if (elm) {
+		block_rec = *elm;
+
+		/* The block was queued speculatively - move it to the top of
+		 * the regular list, unless it is being compiled already */
+		if (block != rec->current_block) {
+			*elm = block_rec->next;
+			block_rec->next = rec->list;
+			rec->list = block_rec;
+#if ENABLE_COMPILER_STATS
+			block_rec->enqueue_time = lightrec_get_time_ns();
+#endif
+		}
+
+		pthread_mutex_unlock(&rec->mutex);
+		return 0;
+	}
+
 	/* By the time this function was called, the block has been recompiled
 	 * and ins't in the wait list anymore. Just return here. */
 	if (block->function) {
@@ -203,6 +299,7 @@ int lightrec_recompiler_add(struct recompiler *rec, struct block *block)
 	block_rec->block = block;
 	block_rec->next = rec->list;
 	rec->list = block_rec;
+	lightrec_recompiler_queued(rec, block_rec);
 
 	/* Signal the thread */
 	pthread_cond_signal(&rec->cond);
@@ -211,36 +308,95 @@ int lightrec_recompiler_add(struct recompiler *rec, struct block *block)
 	return 0;
 }
 
-void lightrec_recompiler_remove(struct recompiler *rec, struct block *block)
+int lightrec_recompiler_add_speculative(struct recompiler *rec,
+					struct block *block)
 {
 	struct block_rec *block_rec;
 
 	pthread_mutex_lock(&rec->mutex);
 
-	for (block_rec = rec->list; block_rec; block_rec = block_rec->next) {
-		if (block_rec->block == block) {
-			if (block == rec->current_block) {
-				/* Block is being recompiled - wait for
-				 * completion */
-				do {
-					pthread_cond_wait(&rec->cond,
-							  &rec->mutex);
-				} while (block == rec->current_block);
-			} else {
-				/* Block is not yet being processed - remove it
-				 * from the list */
-				slist_remove(rec, block_rec);
-				lightrec_free(rec->state, MEM_FOR_LIGHTREC,
-					      sizeof(*block_rec), block_rec);
-			}
+	if (block->function || slist_find(&rec->list, block) ||
+	    slist_find(&rec->spec_list, block)) {
+		pthread_mutex_unlock(&rec->mutex);
+		return 0;
+	}
 
-			break;
+	block_rec = lightrec_malloc(rec->state, MEM_FOR_LIGHTREC,
+				    sizeof(*block_rec));
+	if (!block_rec) {
+		pthread_mutex_unlock(&rec->mutex);
+		return -ENOMEM;
+	}
+
+	pr_debug("Speculatively adding block PC 0x%x to recompiler\n",
+		 block->pc);
+
+	block_rec->block = block;
+	block_rec->next = rec->spec_list;
+	rec->spec_list = block_rec;
+	lightrec_recompiler_queued(rec, block_rec);
+
+	/* Signal the thread */
+	pthread_cond_signal(&rec->cond);
+	pthread_mutex_unlock(&rec->mutex);
+
+	return 0;
+}
+
+void lightrec_recompiler_remove(struct recompiler *rec, struct block *block)
+{
+	struct block_rec *block_rec, **elm;
+
+	pthread_mutex_lock(&rec->mutex);
+
+	elm = slist_find(&rec->list, block);
+	if (!elm)
+		elm = slist_find(&rec->spec_list, block);
+
+	if (elm) {
+		block_rec = *elm;
+
+		if (block == rec->current_block) {
+			/* Block is being recompiled - wait for completion */
+			do {
+				pthread_cond_wait(&rec->cond, &rec->mutex);
+			} while (block == rec->current_block);
+		} else {
+			/* Block is not yet being processed - remove it from
+			 * the list */
+			slist_remove(rec, block_rec);
+			lightrec_recompiler_dequeued(rec);
+			lightrec_free(rec->state, MEM_FOR_LIGHTREC,
+				      sizeof(*block_rec), block_rec);
 		}
 	}
 
 	pthread_mutex_unlock(&rec->mutex);
 }
 
+void lightrec_recompiler_pause(struct recompiler *rec)
+{
+	pthread_mutex_lock(&rec->mutex);
+
+	rec->paused = true;
+
+	/* Wait for the block being compiled, if any */
+	while (rec->current_block)
+		pthread_cond_wait(&rec->cond, &rec->mutex);
+
+	pthread_mutex_unlock(&rec->mutex);
+}
+
+void lightrec_recompiler_unpause(struct recompiler *rec)
+{
+	pthread_mutex_lock(&rec->mutex);
+
+	rec->paused = false;
+	pthread_cond_signal(&rec->cond);
+
+	pthread_mutex_unlock(&rec->mutex);
+}
+
 void * lightrec_recompiler_run_first_pass(struct block *block, u32 *pc)
 {
 	bool freed;
@@ -271,6 +427,10 @@ void * lightrec_recompiler_run_first_pass(struct block *block, u32 *pc)
 	/* Block wasn't compiled yet - run the interpreter */
 	*pc = lightrec_emulate_block(block, *pc);
 
+#if ENABLE_COMPILER_STATS
+	block->state->rec->nb_interpreted++;
+#endif
+
 	if (!freed)
 		atomic_flag_clear(&block->op_list_freed);
 
@@ -287,3 +447,40 @@ void * lightrec_recompiler_run_first_pass(struct block *block, u32 *pc)
 
 	return NULL;
 }
+
+#if ENABLE_COMPILER_STATS
+void lightrec_recompiler_get_stats(struct recompiler *rec,
+				   struct lightrec_compiler_stats *stats)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&rec->mutex);
+
+	stats->stages[LIGHTREC_STAGE_QUEUE_WAIT] = rec->queue_wait;
+	stats->queue_depth = rec->queue_depth;
+	stats->max_queue_depth = rec->max_queue_depth;
+	stats->nb_interpreted = rec->nb_interpreted;
+
+	for (i = 0; i < LIGHTREC_STATS_HIST_SIZE; i++)
+		stats->queue_histogram[i] = rec->queue_histogram[i];
+
+	pthread_mutex_unlock(&rec->mutex);
+}
+
+void lightrec_recompiler_reset_stats(struct recompiler *rec)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&rec->mutex);
+
+	/* The queue depth is not a counter - keep it */
+	rec->queue_wait = (struct lightrec_stage_stats){ 0 };
+	rec->max_queue_depth = rec->queue_depth;
+	rec->nb_interpreted = 0;
+
+	for (i = 0; i < LIGHTREC_STATS_HIST_SIZE; i++)
+		rec->queue_histogram[i] = 0;
+
+	pthread_mutex_unlock(&rec->mutex);
+}
+#endif
@@ -16,14 +16,26 @@
 #define __LIGHTREC_RECOMPILER_H__
 
 struct block;
+struct lightrec_compiler_stats;
 struct lightrec_state;
 struct recompiler;
 
 struct recompiler *lightrec_recompiler_init(struct lightrec_state *state);
 void lightrec_free_recompiler(struct recompiler *rec);
 int lightrec_recompiler_add(struct recompiler *rec, struct block *block);
+int lightrec_recompiler_add_speculative(struct recompiler *rec,
+					struct block *block);
 void lightrec_recompiler_remove(struct recompiler *rec, struct block *block);
 
+/* Wait for the current compilation to end, and don't start new ones until
+ * lightrec_recompiler_unpause() is called */
+void lightrec_recompiler_pause(struct recompiler *rec);
+void lightrec_recompiler_unpause(struct recompiler *rec);
+
 void * lightrec_recompiler_run_first_pass(struct block *block, u32 *pc);
 
+void lightrec_recompiler_get_stats(struct recompiler *rec,
+				   struct lightrec_compiler_stats *stats);
+void lightrec_recompiler_reset_stats(struct recompiler *rec);
+
 #endif /* __LIGHTREC_RECOMPILER_H__ */